@@ -0,0 +1,133 @@
+﻿#include "assetloader.h"
+
+#include <algorithm>
+
+#include "texturecache.h"
+
+AssetLoader& AssetLoader::instance()
+{
+    static AssetLoader loader(std::max(2, (int)std::thread::hardware_concurrency() / 2));
+    return loader;
+}
+
+AssetLoader::AssetLoader(int nthreads): running_(0), stop_(false)
+{
+    for (int i = 0; i < nthreads; ++i)
+    {
+        threads_.emplace_back(&AssetLoader::worker, this);
+    }
+}
+
+AssetLoader::~AssetLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : threads_)
+    {
+        t.join();
+    }
+}
+
+void AssetLoader::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+void AssetLoader::worker()
+{
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this]
+            {
+                return stop_ || !queue_.empty();
+            });
+            // queued loads are finished before shutting down, someone may be waiting on them
+            if (queue_.empty())
+            {
+                return;
+            }
+            task = std::move(queue_.front());
+            queue_.pop_front();
+            running_++;
+        }
+        task();
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_--;
+    }
+}
+
+AssetLoader::TextureFuture AssetLoader::load_texture(const std::string& path)
+{
+    // the cache already dedupes concurrent loads of one path
+    auto task = std::make_shared<std::packaged_task<std::shared_ptr<TGAImage>()>>([path]
+    {
+        return TextureCache::instance().load(path);
+    });
+    TextureFuture future = task->get_future().share();
+    submit([task]
+    {
+        (*task)();
+    });
+    return future;
+}
+
+AssetLoader::ModelFuture AssetLoader::load_model(const std::string& path, bool optimize)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = std::make_pair(path, optimize);
+    auto it = models_.find(key);
+    if (it != models_.end())
+    {
+        return it->second;
+    }
+
+    // the tasks share the prefetched textures until the last of them is done, by then the model references them,
+    // so TextureCache::evict_unused() can't drop them in between
+    auto textures = std::make_shared<std::vector<std::shared_ptr<TGAImage>>>(Model::NTEXTURES);
+    for (int i = 0; i < Model::NTEXTURES; ++i)
+    {
+        std::string texture = Model::texture_path(path, Model::TEXTURE_SUFFIXES[i]);
+        const bool optional = i >= Model::REQUIRED_TEXTURES;
+        queue_.push_back([texture, optional, textures, i]
+        {
+            (*textures)[i] = TextureCache::instance().load(texture, optional);
+        });
+    }
+    auto task = std::make_shared<std::packaged_task<std::shared_ptr<Model>()>>([path, optimize, textures]
+    {
+        return std::make_shared<Model>(path.c_str(), optimize);
+    });
+    ModelFuture future = task->get_future().share();
+    queue_.push_back([task]
+    {
+        (*task)();
+    });
+    models_[key] = future;
+    wake_.notify_all();
+    return future;
+}
+
+std::shared_ptr<Model> AssetLoader::take_model(const std::string& path, bool optimize)
+{
+    ModelFuture future = load_model(path, optimize);
+    std::shared_ptr<Model> model = future.get();
+    std::lock_guard<std::mutex> lock(mutex_);
+    models_.erase(std::make_pair(path, optimize));
+    return model;
+}
+
+int AssetLoader::pending()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)queue_.size() + running_;
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Loads models and textures on background I/O threads so the render thread only waits when it actually
+ * needs the data. Requests return shared futures; repeated requests for the same file share one load.
+ * Textures go through the TextureCache, so a model constructed while its textures are still in flight waits on
+ * those loads instead of reading the files again.
+ * The threads are separate from the ThreadPool since they mostly block on the disk.
+ */
+class AssetLoader
+{
+public:
+    typedef std::shared_future<std::shared_ptr<Model>> ModelFuture;
+    typedef std::shared_future<std::shared_ptr<TGAImage>> TextureFuture;
+
+    static AssetLoader& instance();
+
+    explicit AssetLoader(int nthreads);
+    ~AssetLoader();
+
+    AssetLoader(const AssetLoader&) = delete;
+    AssetLoader& operator=(const AssetLoader&) = delete;
+
+    TextureFuture load_texture(const std::string& path);
+
+    /**
+     * \brief Start loading a model. Its companion textures are requested first, so they decode while the obj
+     * is parsed.
+     */
+    ModelFuture load_model(const std::string& path, bool optimize = false);
+
+    /**
+     * \brief Wait for a model and hand it over: the loader forgets it, so the next request loads it again.
+     * Loads it now if it wasn't requested before.
+     */
+    std::shared_ptr<Model> take_model(const std::string& path, bool optimize = false);
+
+    // requests queued or running
+    int pending();
+
+private:
+    void submit(std::function<void()> task);
+    void worker();
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<std::thread> threads_;
+    int running_;
+    bool stop_;
+    // keyed by path and whether the mesh is optimized
+    std::map<std::pair<std::string, bool>, ModelFuture> models_;
+};
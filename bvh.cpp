@@ -0,0 +1,423 @@
+﻿#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include "model.h"
+
+namespace
+{
+    // subtrees with fewer faces than this are built on the calling thread
+    const int PARALLEL_BUILD_THRESHOLD = 4096;
+
+    struct Bounds
+    {
+        Vec3f lo;
+        Vec3f hi;
+
+        Bounds()
+            : lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max()),
+              hi(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(),
+                 -std::numeric_limits<float>::max())
+        {
+        }
+
+        void grow(const Vec3f& p)
+        {
+            lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+            hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+        }
+
+        void grow(const Bounds& b)
+        {
+            grow(b.lo);
+            grow(b.hi);
+        }
+
+        float area() const
+        {
+            Vec3f d = hi - lo;
+            if (d.x < 0)
+            {
+                return 0.f;
+            }
+            return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+    };
+
+    struct BuildNode
+    {
+        Bounds bounds;
+        int start;
+        int count;
+        std::unique_ptr<BuildNode> left;
+        std::unique_ptr<BuildNode> right;
+        int size;
+    };
+
+    struct Builder
+    {
+        std::vector<Bounds> primbounds;
+        std::vector<Vec3f> centroids;
+        std::vector<int>& faces;
+
+        explicit Builder(std::vector<int>& faces)
+            : faces(faces)
+        {
+        }
+
+        std::unique_ptr<BuildNode> build(int start, int end, int depth)
+        {
+            std::unique_ptr<BuildNode> node(new BuildNode());
+            node->start = start;
+            node->count = end - start;
+            node->size = 1;
+            Bounds centroidbounds;
+            for (int i = start; i < end; ++i)
+            {
+                node->bounds.grow(primbounds[faces[i]]);
+                centroidbounds.grow(centroids[faces[i]]);
+            }
+            if (node->count <= BVH::LEAF_SIZE || depth >= BVH::MAX_DEPTH)
+            {
+                return node;
+            }
+
+            // Binned SAH: bucket the centroids along each axis and evaluate the split planes between buckets
+            int bestaxis = -1;
+            int bestsplit = 0;
+            float bestcost = std::numeric_limits<float>::max();
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float lo = centroidbounds.lo.raw[axis];
+                const float extent = centroidbounds.hi.raw[axis] - lo;
+                if (extent <= 0.f)
+                {
+                    continue;
+                }
+                Bounds binbounds[BVH::SAH_BINS];
+                int bincount[BVH::SAH_BINS] = {};
+                const float binscale = BVH::SAH_BINS / extent;
+                for (int i = start; i < end; ++i)
+                {
+                    int b = std::min(BVH::SAH_BINS - 1, (int)((centroids[faces[i]].raw[axis] - lo) * binscale));
+                    binbounds[b].grow(primbounds[faces[i]]);
+                    bincount[b]++;
+                }
+
+                float rightarea[BVH::SAH_BINS];
+                int rightcount[BVH::SAH_BINS];
+                Bounds acc;
+                int n = 0;
+                for (int b = BVH::SAH_BINS - 1; b > 0; --b)
+                {
+                    acc.grow(binbounds[b]);
+                    n += bincount[b];
+                    rightarea[b] = acc.area();
+                    rightcount[b] = n;
+                }
+                acc = Bounds();
+                n = 0;
+                for (int b = 0; b < BVH::SAH_BINS - 1; ++b)
+                {
+                    acc.grow(binbounds[b]);
+                    n += bincount[b];
+                    float cost = n * acc.area() + rightcount[b + 1] * rightarea[b + 1];
+                    if (n > 0 && rightcount[b + 1] > 0 && cost < bestcost)
+                    {
+                        bestcost = cost;
+                        bestaxis = axis;
+                        bestsplit = b;
+                    }
+                }
+            }
+
+            int mid;
+            if (bestaxis < 0)
+            {
+                // every centroid coincides, split the list in half
+                mid = start + node->count / 2;
+            }
+            else
+            {
+                const float lo = centroidbounds.lo.raw[bestaxis];
+                const float binscale = BVH::SAH_BINS / (centroidbounds.hi.raw[bestaxis] - lo);
+                mid = (int)(std::partition(faces.begin() + start, faces.begin() + end, [&](int f)
+                {
+                    return std::min(BVH::SAH_BINS - 1, (int)((centroids[f].raw[bestaxis] - lo) * binscale)) <= bestsplit;
+                }) - faces.begin());
+            }
+
+            // Children touch disjoint ranges of faces, so the big ones can be built concurrently
+            if (node->count >= PARALLEL_BUILD_THRESHOLD && depth < 4)
+            {
+                std::future<std::unique_ptr<BuildNode>> left = std::async(std::launch::async, [=]
+                {
+                    return build(start, mid, depth + 1);
+                });
+                node->right = build(mid, end, depth + 1);
+                node->left = left.get();
+            }
+            else
+            {
+                node->left = build(start, mid, depth + 1);
+                node->right = build(mid, end, depth + 1);
+            }
+            node->size += node->left->size + node->right->size;
+            return node;
+        }
+    };
+
+    void flatten(const BuildNode* node, std::vector<BVHNode>& nodes)
+    {
+        const int idx = (int)nodes.size();
+        nodes.push_back(BVHNode{node->bounds.lo, node->bounds.hi, node->start, node->count});
+        if (node->left)
+        {
+            nodes[idx].count = 0;
+            flatten(node->left.get(), nodes);
+            nodes[idx].offset = (int)nodes.size();
+            flatten(node->right.get(), nodes);
+        }
+    }
+
+    /**
+     * \brief Where a box lands relative to the screen: 0 off screen, 1 partially, 2 entirely on it
+     */
+    int classify(const float m[4][4], const Vec3f& lo, const Vec3f& hi, int width, int height)
+    {
+        int left = 0, right = 0, below = 0, above = 0, inside = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            const float x = i & 1 ? hi.x : lo.x;
+            const float y = i & 2 ? hi.y : lo.y;
+            const float z = i & 4 ? hi.z : lo.z;
+            const float w = m[3][0] * x + m[3][1] * y + m[3][2] * z + m[3][3];
+            if (w <= 0.f)
+            {
+                // crosses the camera plane, can't be classified from its projection
+                return 1;
+            }
+            const float sx = (m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3]) / w;
+            const float sy = (m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3]) / w;
+            left += sx < 0;
+            right += sx >= width;
+            below += sy < 0;
+            above += sy >= height;
+            inside += sx >= 0 && sx < width && sy >= 0 && sy < height;
+        }
+        if (left == 8 || right == 8 || below == 8 || above == 8)
+        {
+            return 0;
+        }
+        return inside == 8 ? 2 : 1;
+    }
+
+    bool intersect_box(const BVHNode& node, const Vec3f& orig, const Vec3f& invdir, float tmax)
+    {
+        float t0 = 0.f;
+        float t1 = tmax;
+        for (int a = 0; a < 3; ++a)
+        {
+            float tnear = (node.lo.raw[a] - orig.raw[a]) * invdir.raw[a];
+            float tfar = (node.hi.raw[a] - orig.raw[a]) * invdir.raw[a];
+            if (tnear > tfar)
+            {
+                std::swap(tnear, tfar);
+            }
+            t0 = std::max(t0, tnear);
+            t1 = std::min(t1, tfar);
+            if (t0 > t1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+BVH::BVH()
+{
+}
+
+void BVH::build(Model& model)
+{
+    const int nfaces = model.nfaces();
+    faces_.resize(nfaces);
+    Builder builder(faces_);
+    builder.primbounds.resize(nfaces);
+    builder.centroids.resize(nfaces);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        faces_[i] = i;
+        for (int j = 0; j < 3; ++j)
+        {
+            builder.primbounds[i].grow(model.vert(i, j));
+        }
+        builder.centroids[i] = (builder.primbounds[i].lo + builder.primbounds[i].hi) * .5f;
+    }
+
+    nodes_.clear();
+    if (nfaces == 0)
+    {
+        return;
+    }
+    std::unique_ptr<BuildNode> root = builder.build(0, nfaces, 0);
+    nodes_.reserve(root->size);
+    flatten(root.get(), nodes_);
+}
+
+bool BVH::intersect(Model& model, Vec3f orig, Vec3f dir, RayHit& hit)
+{
+    if (nodes_.empty())
+    {
+        return false;
+    }
+    Vec3f invdir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    hit.face = -1;
+    hit.t = std::numeric_limits<float>::max();
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode& node = nodes_[stack[--top]];
+        if (!intersect_box(node, orig, invdir, hit.t))
+        {
+            continue;
+        }
+        if (node.count == 0)
+        {
+            stack[top++] = node.offset;
+            stack[top++] = (int)(&node - nodes_.data()) + 1;
+            continue;
+        }
+        for (int i = node.offset; i < node.offset + node.count; ++i)
+        {
+            // Moller-Trumbore
+            const int f = faces_[i];
+            Vec3f v0 = model.vert(f, 0);
+            Vec3f e1 = model.vert(f, 1) - v0;
+            Vec3f e2 = model.vert(f, 2) - v0;
+            Vec3f p = dir ^ e2;
+            float det = e1 * p;
+            if (std::fabs(det) < 1e-12f)
+            {
+                continue;
+            }
+            float invdet = 1.f / det;
+            Vec3f s = orig - v0;
+            float u = (s * p) * invdet;
+            if (u < 0.f || u > 1.f)
+            {
+                continue;
+            }
+            Vec3f q = s ^ e1;
+            float v = (dir * q) * invdet;
+            if (v < 0.f || u + v > 1.f)
+            {
+                continue;
+            }
+            float t = (e2 * q) * invdet;
+            if (t > 0.f && t < hit.t)
+            {
+                hit.t = t;
+                hit.face = f;
+                hit.bar = Vec3f(1.f - u - v, u, v);
+            }
+        }
+    }
+    return hit.face >= 0;
+}
+
+void BVH::cull(const Matrix& transform, int width, int height, std::vector<int>& faces)
+{
+    if (nodes_.empty())
+    {
+        return;
+    }
+    float m[4][4];
+    Matrix t = transform;
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            m[i][j] = t[i][j];
+        }
+    }
+
+    if (classify(m, nodes_[0].lo, nodes_[0].hi, width, height) == 2)
+    {
+        // entirely on screen, every face in model order without sorting
+        const size_t first = faces.size();
+        faces.resize(first + faces_.size());
+        for (size_t i = 0; i < faces_.size(); ++i)
+        {
+            faces[first + i] = (int)i;
+        }
+        return;
+    }
+
+    const size_t first = faces.size();
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const int idx = stack[--top];
+        const BVHNode& node = nodes_[idx];
+        const int where = classify(m, node.lo, node.hi, width, height);
+        if (where == 0)
+        {
+            continue;
+        }
+        if (where == 2 || node.count > 0)
+        {
+            // Entirely on screen or a leaf: take every face below it, in one contiguous range
+            int first = node.count > 0 ? node.offset : -1;
+            int last = -1;
+            // the subtree's leaves are contiguous in faces_, find them from its leftmost and rightmost leaves
+            if (node.count == 0)
+            {
+                int l = idx;
+                while (nodes_[l].count == 0)
+                {
+                    l = l + 1;
+                }
+                int r = idx;
+                while (nodes_[r].count == 0)
+                {
+                    r = nodes_[r].offset;
+                }
+                first = nodes_[l].offset;
+                last = nodes_[r].offset + nodes_[r].count;
+            }
+            else
+            {
+                last = node.offset + node.count;
+            }
+            faces.insert(faces.end(), faces_.begin() + first, faces_.begin() + last);
+            continue;
+        }
+        stack[top++] = node.offset;
+        stack[top++] = idx + 1;
+    }
+    // leaves come out in tree order
+    std::sort(faces.begin() + first, faces.end());
+}
+
+int BVH::nnodes()
+{
+    return (int)nodes_.size();
+}
+
+BVHNode& BVH::node(int idx)
+{
+    return nodes_[idx];
+}
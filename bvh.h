@@ -0,0 +1,69 @@
+﻿#pragma once
+#include <vector>
+#include "geometry.h"
+
+class Model;
+
+/**
+ * \brief Node of the flattened hierarchy. Nodes are stored depth first, so an interior node's left child
+ * directly follows it and `offset` is the index of its right child. For leaves `offset` is the first entry
+ * of BVH::faces and `count` the number of faces.
+ */
+struct BVHNode
+{
+    Vec3f lo;
+    Vec3f hi;
+    int offset;
+    int count;
+};
+
+struct RayHit
+{
+    int face;
+    // distance along the ray direction
+    float t;
+    // barycentric coordinates of the hit on the face
+    Vec3f bar;
+};
+
+/**
+ * \brief Bounding volume hierarchy over a Model's faces, built with binned SAH.
+ * Used to skip off-screen triangle clusters before the vertex stage and to answer ray picking queries.
+ */
+class BVH
+{
+public:
+    // a node with this many faces or fewer is never split
+    static const int LEAF_SIZE = 4;
+    static const int SAH_BINS = 16;
+    // deeper nodes become leaves, bounds the traversal stacks
+    static const int MAX_DEPTH = 48;
+
+    BVH();
+
+    /**
+     * \brief Build over every face of the model, large subtrees are built on separate threads
+     */
+    void build(Model& model);
+
+    /**
+     * \brief Closest face hit by the ray orig + t * dir, t > 0, in object space
+     */
+    bool intersect(Model& model, Vec3f orig, Vec3f dir, RayHit& hit);
+
+    /**
+     * \brief Append the faces of every leaf whose bounds may land on the width x height screen, in the model's
+     * face order so the order the vertex cache optimization chose survives
+     * \param transform Object space to screen space
+     */
+    void cull(const Matrix& transform, int width, int height, std::vector<int>& faces);
+
+    int nnodes();
+
+    BVHNode& node(int idx);
+
+private:
+    std::vector<BVHNode> nodes_;
+    // face indices, leaves reference contiguous ranges of it
+    std::vector<int> faces_;
+};
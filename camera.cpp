@@ -0,0 +1,104 @@
+﻿#include "camera.h"
+
+#include <algorithm>
+#include <cmath>
+
+Camera::Camera()
+    : eye_(0, 0, 3),
+      center_(0, 0, 0),
+      up_(0, 1, 0),
+      fov_(0.f),
+      half_height_(1.f),
+      aspect_(1.f),
+      viewport_(::viewport(-1, -1, 2, 2, 2))
+{
+    update();
+}
+
+void Camera::look_at(Vec3f eye, Vec3f center, Vec3f up)
+{
+    eye_ = eye;
+    center_ = center;
+    up_ = up;
+    update();
+}
+
+void Camera::perspective(float fov)
+{
+    fov_ = std::max(fov, 0.f);
+    update();
+}
+
+void Camera::orthographic(float half_height)
+{
+    fov_ = -1.f;
+    half_height_ = half_height;
+    update();
+}
+
+void Camera::set_viewport(int x, int y, int w, int h, int depth)
+{
+    viewport_ = ::viewport(x, y, w, h, depth);
+    aspect_ = (float)w / h;
+    update();
+}
+
+Vec3f Camera::eye() const
+{
+    return eye_;
+}
+
+Vec3f Camera::center() const
+{
+    return center_;
+}
+
+float Camera::distance() const
+{
+    return fov_ < 0.f ? 0.f : (eye_ - center_).norm();
+}
+
+const Matrix& Camera::view() const
+{
+    return view_;
+}
+
+const Matrix& Camera::projection() const
+{
+    return projection_;
+}
+
+const Matrix& Camera::viewport() const
+{
+    return viewport_;
+}
+
+const Matrix& Camera::transform() const
+{
+    return transform_;
+}
+
+void Camera::update()
+{
+    view_ = lookat(eye_, center_, up_);
+    projection_ = Matrix::identity(4);
+    if (fov_ < 0.f)
+    {
+        const float s = 1.f / half_height_;
+        projection_[0][0] = s / aspect_;
+        projection_[1][1] = s;
+        projection_[2][2] = s;
+    }
+    else
+    {
+        const float d = distance();
+        projection_[3][2] = -1.f / d;
+        if (fov_ > 0.f)
+        {
+            const float s = 1.f / (d * std::tan(fov_ * 3.14159265358979f / 360.f));
+            projection_[0][0] = s / aspect_;
+            projection_[1][1] = s;
+        }
+    }
+    transform_ = viewport_ * projection_ * view_;
+}
@@ -0,0 +1,67 @@
+﻿#pragma once
+#include "geometry.h"
+
+/**
+ * \brief View, projection and viewport of a camera, multiplied once into the object independent part of the
+ * vertex transform: transform() = viewport() * projection() * view().
+ * View space follows lookat(): center sits at the origin and the eye on +z at distance() from it.
+ */
+class Camera
+{
+public:
+    /**
+     * \brief Looking from (0, 0, 3) at the origin with the perspective of perspective(0), onto a 2x2 viewport
+     */
+    Camera();
+
+    void look_at(Vec3f eye, Vec3f center, Vec3f up = Vec3f(0, 1, 0));
+
+    /**
+     * \brief Perspective projection, points on the plane through center keep w = 1
+     * \param fov Vertical field of view in degrees, x is scaled to keep the pixels square.
+     * 0 maps the plane through center's [-1, 1] square onto the whole viewport instead, whatever its aspect.
+     */
+    void perspective(float fov = 0.f);
+
+    /**
+     * \brief Orthographic projection showing half_height above and below center, x is scaled to keep the pixels
+     * square. Depth is scaled alike, so the view space box of that size fills the depth range.
+     */
+    void orthographic(float half_height);
+
+    /**
+     * \brief Map the projection's [-1, 1] cube onto the w x h rectangle at (x, y) and depths [0, depth]
+     */
+    void set_viewport(int x, int y, int w, int h, int depth);
+
+    Vec3f eye() const;
+    Vec3f center() const;
+
+    /**
+     * \brief Distance from the eye to center, the perspective divide is w = 1 - z / distance in view space.
+     * 0 for orthographic projections.
+     */
+    float distance() const;
+
+    const Matrix& view() const;
+    const Matrix& projection() const;
+    const Matrix& viewport() const;
+
+    // world space to screen space
+    const Matrix& transform() const;
+
+private:
+    void update();
+
+    Vec3f eye_;
+    Vec3f center_;
+    Vec3f up_;
+    // vertical field of view in degrees, negative for orthographic
+    float fov_;
+    float half_height_;
+    float aspect_;
+    Matrix view_;
+    Matrix projection_;
+    Matrix viewport_;
+    Matrix transform_;
+};
@@ -0,0 +1,255 @@
+﻿#include "cluster.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "model.h"
+
+namespace
+{
+    // a face joins a growing cluster only if its normal is within ~37 degrees of the cluster's average,
+    // which keeps the normal cones narrow enough to be culled
+    const float CLUSTER_NORMAL_THRESHOLD = 0.8f;
+
+    unsigned int expand_bits(unsigned int v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // 30 bit Morton code of a point in the unit cube
+    unsigned int morton(Vec3f p)
+    {
+        unsigned int x = (unsigned int)std::min(std::max(p.x * 1024.f, 0.f), 1023.f);
+        unsigned int y = (unsigned int)std::min(std::max(p.y * 1024.f, 0.f), 1023.f);
+        unsigned int z = (unsigned int)std::min(std::max(p.z * 1024.f, 0.f), 1023.f);
+        return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+    }
+}
+
+ClusterSet::ClusterSet(): closed_(false)
+{
+}
+
+void ClusterSet::build(Model& model, int max_faces)
+{
+    const int nfaces = model.nfaces();
+    const int nverts = model.nverts();
+    clusters_.clear();
+    faces_.clear();
+    faces_.reserve(nfaces);
+
+    // face normals, centroids and vertex indices
+    std::vector<Vec3f> normals(nfaces);
+    std::vector<Vec3f> centroids(nfaces);
+    std::vector<int> corners(nfaces * 3);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        std::vector<Vec3i> face = model.face(i);
+        for (int j = 0; j < 3; ++j)
+        {
+            corners[i * 3 + j] = face[j].ivert;
+        }
+        Vec3f v0 = model.vert(i, 0);
+        Vec3f v1 = model.vert(i, 1);
+        Vec3f v2 = model.vert(i, 2);
+        Vec3f n = (v1 - v0) ^ (v2 - v0);
+        float l = n.norm();
+        normals[i] = l > 0.f ? n * (1.f / l) : Vec3f();
+        centroids[i] = (v0 + v1 + v2) * (1.f / 3.f);
+    }
+
+    // vertex to face adjacency, compressed rows
+    std::vector<int> adjoffset(nverts + 1, 0);
+    for (int c : corners)
+    {
+        adjoffset[c + 1]++;
+    }
+    for (int v = 0; v < nverts; ++v)
+    {
+        adjoffset[v + 1] += adjoffset[v];
+    }
+    std::vector<int> adjfaces(adjoffset[nverts]);
+    std::vector<int> fill(adjoffset.begin(), adjoffset.end() - 1);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            adjfaces[fill[corners[i * 3 + j]]++] = i;
+        }
+    }
+
+    // seeds are taken in Morton order so consecutive clusters are spatially close
+    Vec3f lo = model.bbox_min();
+    Vec3f extent = model.bbox_max() - lo;
+    Vec3f invextent(extent.x > 0 ? 1.f / extent.x : 0.f, extent.y > 0 ? 1.f / extent.y : 0.f,
+                    extent.z > 0 ? 1.f / extent.z : 0.f);
+    std::vector<std::pair<unsigned int, int>> seeds(nfaces);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        Vec3f p = centroids[i] - lo;
+        seeds[i] = std::make_pair(morton(Vec3f(p.x * invextent.x, p.y * invextent.y, p.z * invextent.z)), i);
+    }
+    std::sort(seeds.begin(), seeds.end());
+
+    // closed when every edge is shared by exactly two faces: back faces are then always hidden by front faces
+    std::vector<std::pair<int, int>> edges;
+    edges.reserve(nfaces * 3);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            int a = corners[i * 3 + j];
+            int b = corners[i * 3 + (j + 1) % 3];
+            edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    closed_ = !edges.empty();
+    for (size_t i = 0; i < edges.size() && closed_; i += 2)
+    {
+        closed_ = i + 1 < edges.size() && edges[i] == edges[i + 1] && (i + 2 >= edges.size() || edges[i + 2] != edges[i]);
+    }
+
+    std::vector<char> assigned(nfaces, 0);
+    std::vector<int> queue;
+    for (const auto& seed : seeds)
+    {
+        if (assigned[seed.second])
+        {
+            continue;
+        }
+
+        // grow breadth first through faces sharing a vertex
+        Cluster cluster;
+        cluster.offset = (int)faces_.size();
+        Vec3f normalsum;
+        queue.clear();
+        queue.push_back(seed.second);
+        assigned[seed.second] = 1;
+        for (size_t q = 0; q < queue.size() && (int)faces_.size() - cluster.offset < max_faces; ++q)
+        {
+            const int f = queue[q];
+            faces_.push_back(f);
+            normalsum = normalsum + normals[f];
+            for (int j = 0; j < 3; ++j)
+            {
+                const int v = corners[f * 3 + j];
+                for (int k = adjoffset[v]; k < adjoffset[v + 1]; ++k)
+                {
+                    const int g = adjfaces[k];
+                    if (!assigned[g] && normals[g] * normalsum >= CLUSTER_NORMAL_THRESHOLD * normalsum.norm())
+                    {
+                        assigned[g] = 1;
+                        queue.push_back(g);
+                    }
+                }
+            }
+        }
+        // faces queued but left out when the cluster filled up go back to the pool
+        for (size_t q = faces_.size() - cluster.offset; q < queue.size(); ++q)
+        {
+            assigned[queue[q]] = 0;
+        }
+        cluster.count = (int)faces_.size() - cluster.offset;
+
+        // bounds: sphere around the box center, cone around the average normal
+        Vec3f clo = model.vert(faces_[cluster.offset], 0);
+        Vec3f chi = clo;
+        for (int i = cluster.offset; i < cluster.offset + cluster.count; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                Vec3f v = model.vert(faces_[i], j);
+                clo = Vec3f(std::min(clo.x, v.x), std::min(clo.y, v.y), std::min(clo.z, v.z));
+                chi = Vec3f(std::max(chi.x, v.x), std::max(chi.y, v.y), std::max(chi.z, v.z));
+            }
+        }
+        cluster.center = (clo + chi) * .5f;
+        cluster.radius = 0.f;
+        float axislength = normalsum.norm();
+        cluster.axis = axislength > 0.f ? normalsum * (1.f / axislength) : Vec3f(0, 0, 1);
+        float mindot = 1.f;
+        for (int i = cluster.offset; i < cluster.offset + cluster.count; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                cluster.radius = std::max(cluster.radius, (model.vert(faces_[i], j) - cluster.center).norm());
+            }
+            mindot = std::min(mindot, normals[faces_[i]] * cluster.axis);
+        }
+        cluster.cutoff = mindot <= 0.f ? 1.f : std::sqrt(1.f - mindot * mindot);
+        clusters_.push_back(cluster);
+    }
+}
+
+void ClusterSet::cull(const Matrix& transform, int width, int height, bool cull_back, std::vector<int>& faces)
+{
+    // Screen edges as object space planes a.x + b.y + c.z + d >= 0, from the rows of the transform
+    Matrix m = transform;
+    float planes[5][4];
+    for (int i = 0; i < 4; ++i)
+    {
+        planes[0][i] = m[0][i];
+        planes[1][i] = width * m[3][i] - m[0][i];
+        planes[2][i] = m[1][i];
+        planes[3][i] = height * m[3][i] - m[1][i];
+        // in front of the eye, w > 0
+        planes[4][i] = m[3][i];
+    }
+    float planenorm[5];
+    for (int p = 0; p < 5; ++p)
+    {
+        planenorm[p] = std::sqrt(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] +
+            planes[p][2] * planes[p][2]);
+    }
+
+    Vec3f eye;
+    Vec3f dir;
+    if (cull_back)
+    {
+        screen_ray(transform, width * .5f, height * .5f, eye, dir);
+    }
+
+    for (const Cluster& cluster : clusters_)
+    {
+        bool outside = false;
+        for (int p = 0; p < 5 && !outside; ++p)
+        {
+            float d = planes[p][0] * cluster.center.x + planes[p][1] * cluster.center.y +
+                planes[p][2] * cluster.center.z + planes[p][3];
+            outside = d < -cluster.radius * planenorm[p];
+        }
+        if (outside)
+        {
+            continue;
+        }
+        if (cull_back)
+        {
+            Vec3f view = cluster.center - eye;
+            if (view * cluster.axis >= cluster.cutoff * view.norm() + cluster.radius)
+            {
+                continue;
+            }
+        }
+        faces.insert(faces.end(), faces_.begin() + cluster.offset, faces_.begin() + cluster.offset + cluster.count);
+    }
+}
+
+bool ClusterSet::closed()
+{
+    return closed_;
+}
+
+int ClusterSet::nclusters()
+{
+    return (int)clusters_.size();
+}
+
+Cluster& ClusterSet::cluster(int idx)
+{
+    return clusters_[idx];
+}
@@ -0,0 +1,55 @@
+﻿#pragma once
+#include <vector>
+#include "geometry.h"
+
+class Model;
+
+/**
+ * \brief A small patch of neighbouring faces with conservative bounds for culling before the vertex stage
+ */
+struct Cluster
+{
+    // range of ClusterSet::faces
+    int offset;
+    int count;
+    // bounding sphere
+    Vec3f center;
+    float radius;
+    // every face normal lies within the cone around axis whose half angle has cosine `mindot`;
+    // cutoff = sin of that angle, or 1 when the cone is too wide to ever be fully back facing
+    Vec3f axis;
+    float cutoff;
+};
+
+/**
+ * \brief Partition of a Model's faces into clusters of at most max_faces triangles.
+ * A cluster is rejected as a whole when its sphere is outside the screen or when its normal cone faces away from the eye.
+ */
+class ClusterSet
+{
+public:
+    static const int DEFAULT_CLUSTER_FACES = 124;
+
+    ClusterSet();
+
+    void build(Model& model, int max_faces = DEFAULT_CLUSTER_FACES);
+
+    /**
+     * \brief Append the faces of every cluster that may be visible
+     * \param transform Object space to screen space
+     * \param cull_back Also drop clusters whose faces all face away from the eye
+     */
+    void cull(const Matrix& transform, int width, int height, bool cull_back, std::vector<int>& faces);
+
+    // true when the mesh is watertight, so back facing clusters can be dropped even for shaders that don't cull
+    bool closed();
+
+    int nclusters();
+
+    Cluster& cluster(int idx);
+
+private:
+    std::vector<Cluster> clusters_;
+    std::vector<int> faces_;
+    bool closed_;
+};
@@ -0,0 +1,198 @@
+﻿#include "depthexport.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "imageencoder.h"
+
+namespace
+{
+    /**
+     * \brief Affine map from (possibly linearized) z to [0, 1], background pixels go to 0
+     */
+    struct DepthMap
+    {
+        float scale;
+        float offset;
+        float halfdepth;
+        float camera;
+    };
+
+    inline float linearize(float z, float halfdepth, float camera)
+    {
+        // undo the viewport, then the projection: z' = z / (1 - z / c)  =>  z = z' * c / (c + z')
+        const float ndc = z / halfdepth - 1.f;
+        return ndc * camera / (camera + ndc);
+    }
+
+    DepthMap depth_map(DepthBuffer& zbuffer, const DepthExport& settings)
+    {
+        const float halfdepth = settings.zmax * .5f;
+        float lo = settings.zmin;
+        float hi = settings.zmax;
+        if (settings.normalize)
+        {
+            // min over the drawn pixels only, the background holds CLEAR_DEPTH
+            const int* z = zbuffer.buffer();
+            const size_t n = (size_t)zbuffer.get_width() * zbuffer.get_height();
+            int zlo = std::numeric_limits<int>::max();
+            int zhi = DepthBuffer::CLEAR_DEPTH;
+            for (size_t i = 0; i < n; ++i)
+            {
+                zlo = std::min(zlo, z[i] == DepthBuffer::CLEAR_DEPTH ? zlo : z[i]);
+                zhi = std::max(zhi, z[i]);
+            }
+            if (zhi > zlo)
+            {
+                lo = (float)zlo;
+                hi = (float)zhi;
+            }
+        }
+        if (settings.camera != 0.f)
+        {
+            lo = linearize(lo, halfdepth, settings.camera);
+            hi = linearize(hi, halfdepth, settings.camera);
+        }
+
+        DepthMap map;
+        map.scale = hi > lo ? 1.f / (hi - lo) : 0.f;
+        map.offset = -lo * map.scale;
+        map.halfdepth = halfdepth;
+        map.camera = settings.camera;
+        return map;
+    }
+
+    /**
+     * \brief Map one row to [0, fullscale]. Branch free so the loop vectorizes: the background's
+     * CLEAR_DEPTH lands far below the range and clamps to 0.
+     */
+    template <class T, bool Linear>
+    void convert_row(const int* z, int width, const DepthMap& map, float fullscale, T* out)
+    {
+        const float scale = map.scale * fullscale;
+        const float offset = map.offset * fullscale;
+        for (int x = 0; x < width; ++x)
+        {
+            float v = (float)z[x];
+            if (Linear)
+            {
+                // keeps the background away from the pole of the division, it maps to the far end
+                v = std::max(v, 0.f);
+                v = linearize(v, map.halfdepth, map.camera);
+            }
+            v = std::min(std::max(v * scale + offset, 0.f), fullscale);
+            out[x] = (T)(std::is_floating_point<T>::value ? v : v + .5f);
+        }
+    }
+
+    template <class T>
+    void convert_row(const int* z, int width, const DepthMap& map, float fullscale, T* out)
+    {
+        if (map.camera != 0.f)
+        {
+            convert_row<T, true>(z, width, map, fullscale, out);
+        }
+        else
+        {
+            convert_row<T, false>(z, width, map, fullscale, out);
+        }
+    }
+
+    template <class T>
+    bool write_raw(DepthBuffer& zbuffer, const DepthMap& map, float fullscale, const char* filename)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out.is_open())
+        {
+            std::cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        const int width = zbuffer.get_width();
+        std::vector<T> row(width);
+        for (int y = zbuffer.get_height() - 1; y >= 0; --y)
+        {
+            convert_row(zbuffer.row(y), width, map, fullscale, row.data());
+            out.write((const char*)row.data(), width * sizeof(T));
+        }
+        if (!out.good())
+        {
+            std::cerr << "can't dump the depth file\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool write_pfm_depth(DepthBuffer& zbuffer, const DepthMap& map, const char* filename)
+    {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out.is_open())
+        {
+            std::cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        // PFM stores the bottom row first, like the buffer
+        const int width = zbuffer.get_width();
+        const int height = zbuffer.get_height();
+        std::vector<float> values((size_t)width * height);
+        for (int y = 0; y < height; ++y)
+        {
+            convert_row(zbuffer.row(y), width, map, 1.f, values.data() + (size_t)y * width);
+        }
+        return write_pfm(out, values.data(), width, height, 1);
+    }
+}
+
+void depth_to_image(DepthBuffer& zbuffer, const DepthExport& settings, TGAImage& out)
+{
+    const int width = zbuffer.get_width();
+    const int height = zbuffer.get_height();
+    if (out.get_width() != width || out.get_height() != height || out.get_bytespp() != TGAImage::GRAYSCALE)
+    {
+        out = TGAImage(width, height, TGAImage::GRAYSCALE, out.get_allocator());
+    }
+    DepthMap map = depth_map(zbuffer, settings);
+    for (int y = 0; y < height; ++y)
+    {
+        convert_row(zbuffer.row(y), width, map, 255.f, out.buffer() + (size_t)y * width);
+    }
+}
+
+bool write_depth(DepthBuffer& zbuffer, const DepthExport& settings, const char* filename)
+{
+    if (settings.format == DepthExport::RAW16)
+    {
+        return write_raw<uint16_t>(zbuffer, depth_map(zbuffer, settings), 65535.f, filename);
+    }
+    if (settings.format == DepthExport::RAW32)
+    {
+        return write_raw<float>(zbuffer, depth_map(zbuffer, settings), 1.f, filename);
+    }
+    if (settings.format == DepthExport::PFM)
+    {
+        return write_pfm_depth(zbuffer, depth_map(zbuffer, settings), filename);
+    }
+    // released back to the pool once written, the next frame's export picks the buffer up again
+    TGAImage image(&FramePool::frames());
+    depth_to_image(zbuffer, settings, image);
+    return image.write_tga_file(filename);
+}
+
+const char* depth_extension(DepthExport::Format format)
+{
+    switch (format)
+    {
+    case DepthExport::RAW16:
+        return ".r16";
+    case DepthExport::RAW32:
+        return ".r32";
+    case DepthExport::PFM:
+        return ".pfm";
+    default:
+        return ".tga";
+    }
+}
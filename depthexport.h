@@ -0,0 +1,51 @@
+﻿#pragma once
+#include "framebuffer.h"
+#include "tgaimage.h"
+
+/**
+ * \brief How z-buffer values map to exported depth, 0 for the background and the far end up to full scale for
+ * the closest point.
+ */
+struct DepthExport
+{
+    enum Format
+    {
+        // 8 bit GRAYSCALE tga
+        GRAY8,
+        // headerless little-endian uint16 / float32, width * height values, top row first
+        RAW16,
+        RAW32,
+        // grayscale float map
+        PFM
+    };
+
+    explicit DepthExport(int depth): format(GRAY8), zmin(0.f), zmax((float)depth), camera(0.f), normalize(false)
+    {
+    }
+
+    Format format;
+    // z-buffer values mapped to 0 and to full scale, the viewport's depth range by default
+    float zmin;
+    float zmax;
+    // camera distance of the perspective projection, the z-buffer holds depth / 2 * (z / (1 - z / camera) + 1).
+    // Non-zero undoes the perspective division so equal steps in the output are equal distances in the scene.
+    float camera;
+    // stretch the range of the drawn pixels to the full scale instead of using [zmin, zmax]
+    bool normalize;
+};
+
+/**
+ * \brief Convert a depth buffer to a GRAYSCALE image in one pass over the buffer
+ * \param out Resized to the buffer's dimensions if needed
+ */
+void depth_to_image(DepthBuffer& zbuffer, const DepthExport& settings, TGAImage& out);
+
+/**
+ * \brief Write a depth buffer in the settings' format
+ */
+bool write_depth(DepthBuffer& zbuffer, const DepthExport& settings, const char* filename);
+
+/**
+ * \brief File extension for the format, with the dot
+ */
+const char* depth_extension(DepthExport::Format format);
@@ -0,0 +1,158 @@
+﻿#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "tgaimage.h"
+
+// bound by reference in std::fill, so the constant needs its definition
+const int DepthBuffer::CLEAR_DEPTH;
+
+DepthBuffer::DepthBuffer(int w, int h)
+    : data_((size_t)w * h, CLEAR_DEPTH),
+      width_(w),
+      height_(h),
+      tilesx_((w + DEPTH_TILE - 1) / DEPTH_TILE),
+      tilesy_((h + DEPTH_TILE - 1) / DEPTH_TILE)
+{
+    tilemin_.assign((size_t)tilesx_ * tilesy_, CLEAR_DEPTH);
+    pending_.assign((size_t)tilesx_ * tilesy_, 0);
+}
+
+void DepthBuffer::clear()
+{
+    std::fill(data_.begin(), data_.end(), CLEAR_DEPTH);
+    std::fill(tilemin_.begin(), tilemin_.end(), CLEAR_DEPTH);
+    std::fill(pending_.begin(), pending_.end(), 0);
+}
+
+void DepthBuffer::clear_lazy(bool color)
+{
+    std::fill(tilemin_.begin(), tilemin_.end(), CLEAR_DEPTH);
+    std::fill(pending_.begin(), pending_.end(), color ? PENDING_DEPTH | PENDING_COLOR : PENDING_DEPTH);
+}
+
+void DepthBuffer::init_tile(int tx, int ty, TGAImage* image)
+{
+    unsigned char& flags = pending_[tx + ty * tilesx_];
+    const int x0 = tx * DEPTH_TILE;
+    const int y0 = ty * DEPTH_TILE;
+    const int x1 = std::min(width_, x0 + DEPTH_TILE);
+    const int y1 = std::min(height_, y0 + DEPTH_TILE);
+    if (flags & PENDING_DEPTH)
+    {
+        for (int y = y0; y < y1; ++y)
+        {
+            std::fill(row(y) + x0, row(y) + x1, CLEAR_DEPTH);
+        }
+        flags &= ~PENDING_DEPTH;
+    }
+    if ((flags & PENDING_COLOR) && image)
+    {
+        const int bytespp = image->get_bytespp();
+        const size_t stride = (size_t)image->get_width() * bytespp;
+        for (int y = y0; y < y1; ++y)
+        {
+            memset(image->buffer() + y * stride + x0 * bytespp, 0, (size_t)(x1 - x0) * bytespp);
+        }
+        flags &= ~PENDING_COLOR;
+    }
+}
+
+void DepthBuffer::resolve(TGAImage* image)
+{
+    for (int ty = 0; ty < tilesy_; ++ty)
+    {
+        for (int tx = 0; tx < tilesx_; ++tx)
+        {
+            if (tile_pending(tx, ty))
+            {
+                init_tile(tx, ty, image);
+            }
+        }
+    }
+}
+
+void DepthBuffer::clear(const ScreenRect& rect)
+{
+    for (int y = rect.y0; y <= rect.y1; ++y)
+    {
+        std::fill(row(y) + rect.x0, row(y) + rect.x1 + 1, CLEAR_DEPTH);
+    }
+    for (int ty = rect.y0 / DEPTH_TILE; ty <= rect.y1 / DEPTH_TILE; ++ty)
+    {
+        for (int tx = rect.x0 / DEPTH_TILE; tx <= rect.x1 / DEPTH_TILE; ++tx)
+        {
+            update_tile(tx, ty);
+        }
+    }
+}
+
+int DepthBuffer::get(int x, int y)
+{
+    if (x < 0 || y < 0 || x >= width_ || y >= height_ ||
+        (pending_[x / DEPTH_TILE + y / DEPTH_TILE * tilesx_] & PENDING_DEPTH))
+    {
+        return CLEAR_DEPTH;
+    }
+    return data_[x + y * width_];
+}
+
+int* DepthBuffer::row(int y)
+{
+    return data_.data() + (size_t)y * width_;
+}
+
+int* DepthBuffer::buffer()
+{
+    return data_.data();
+}
+
+int DepthBuffer::get_width()
+{
+    return width_;
+}
+
+int DepthBuffer::get_height()
+{
+    return height_;
+}
+
+int DepthBuffer::tiles_x()
+{
+    return tilesx_;
+}
+
+int DepthBuffer::tiles_y()
+{
+    return tilesy_;
+}
+
+int DepthBuffer::tile_min(int tx, int ty)
+{
+    return tilemin_[tx + ty * tilesx_];
+}
+
+void DepthBuffer::update_tile(int tx, int ty)
+{
+    if (pending_[tx + ty * tilesx_] & PENDING_DEPTH)
+    {
+        // nothing was drawn there yet, the pixels are stale
+        tilemin_[tx + ty * tilesx_] = CLEAR_DEPTH;
+        return;
+    }
+    const int x0 = tx * DEPTH_TILE;
+    const int y0 = ty * DEPTH_TILE;
+    const int x1 = std::min(width_, x0 + DEPTH_TILE);
+    const int y1 = std::min(height_, y0 + DEPTH_TILE);
+    int zmin = std::numeric_limits<int>::max();
+    for (int y = y0; y < y1; ++y)
+    {
+        const int* r = row(y);
+        for (int x = x0; x < x1; ++x)
+        {
+            zmin = std::min(zmin, r[x]);
+        }
+    }
+    tilemin_[tx + ty * tilesx_] = zmin;
+}
@@ -0,0 +1,100 @@
+﻿#pragma once
+#include <limits>
+#include <vector>
+
+class TGAImage;
+
+/**
+ * \brief Inclusive pixel rectangle
+ */
+struct ScreenRect
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+/**
+ * \brief Integer z-buffer, bigger values are closer to the viewer.
+ * Alongside the per-pixel depths it keeps the farthest depth of every DEPTH_TILE x DEPTH_TILE tile,
+ * so the rasterizer can reject a whole tile when a triangle is behind everything already drawn there.
+ * clear_lazy() clears in O(tiles) by only flagging the tiles: the rasterizer initializes a flagged tile, and the
+ * matching block of the color image it draws into, the first time it draws there, and resolve() writes the clear
+ * value into the tiles that were never drawn to before the pixels are read directly.
+ */
+class DepthBuffer
+{
+public:
+    static const int DEPTH_TILE = 8;
+    static const int CLEAR_DEPTH = std::numeric_limits<int>::min();
+    // tile flags: the depth, and the color image drawn along with it, still hold the previous frame
+    static const unsigned char PENDING_DEPTH = 1;
+    static const unsigned char PENDING_COLOR = 2;
+
+    DepthBuffer(int w, int h);
+
+    void clear();
+
+    /**
+     * \brief Clear by flagging every tile, without touching the pixels
+     * \param color Clear the color image drawn with this buffer too, to black like TGAImage::clear
+     */
+    void clear_lazy(bool color);
+
+    inline bool tile_pending(int tx, int ty)
+    {
+        return pending_[tx + ty * tilesx_] != 0;
+    }
+
+    /**
+     * \brief Write the clear value into the flagged parts of a tile
+     * \param image Color image drawn with this buffer, null to leave its pending flag for later
+     */
+    void init_tile(int tx, int ty, TGAImage* image);
+
+    /**
+     * \brief Initialize every tile still flagged, once drawing is done and before row(), buffer() or the color
+     * image's pixels are read
+     */
+    void resolve(TGAImage* image);
+
+    /**
+     * \brief Clear the pixels of rect and refresh the farthest depth of the tiles it touches
+     */
+    void clear(const ScreenRect& rect);
+
+    int get(int x, int y);
+
+    // raw pixels, flagged tiles hold stale values until resolve()
+    int* row(int y);
+
+    int* buffer();
+
+    int get_width();
+
+    int get_height();
+
+    int tiles_x();
+
+    int tiles_y();
+
+    /**
+     * \brief Farthest depth stored in the tile, a triangle whose closest point is farther than this is hidden
+     */
+    int tile_min(int tx, int ty);
+
+    /**
+     * \brief Recompute the farthest depth of a tile after its pixels were written
+     */
+    void update_tile(int tx, int ty);
+
+private:
+    std::vector<int> data_;
+    std::vector<int> tilemin_;
+    std::vector<unsigned char> pending_;
+    int width_;
+    int height_;
+    int tilesx_;
+    int tilesy_;
+};
@@ -0,0 +1,108 @@
+﻿#include "framestream.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#ifdef _MSC_VER
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+FdStreamBuf::FdStreamBuf(int fd, size_t buffer_size): fd_(fd), buffer_(buffer_size)
+{
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+FdStreamBuf::~FdStreamBuf()
+{
+    sync();
+}
+
+FdStreamBuf::int_type FdStreamBuf::overflow(int_type c)
+{
+    if (sync() != 0)
+    {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize FdStreamBuf::xsputn(const char* s, std::streamsize n)
+{
+    // large writes, whole frames usually, skip the copy into the buffer
+    if (n >= (std::streamsize)buffer_.size())
+    {
+        if (sync() != 0 || !write_all(s, (size_t)n))
+        {
+            return 0;
+        }
+        return n;
+    }
+    return std::streambuf::xsputn(s, n);
+}
+
+int FdStreamBuf::sync()
+{
+    const size_t n = pptr() - pbase();
+    if (n > 0 && !write_all(pbase(), n))
+    {
+        return -1;
+    }
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return 0;
+}
+
+bool FdStreamBuf::write_all(const char* p, size_t n)
+{
+    while (n > 0)
+    {
+#ifdef _MSC_VER
+        const int written = _write(fd_, p, (unsigned int)std::min(n, (size_t)(1 << 30)));
+#else
+        const ssize_t written = ::write(fd_, p, n);
+#endif
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            std::cerr << "can't write to descriptor " << fd_ << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        p += written;
+        n -= (size_t)written;
+    }
+    return true;
+}
+
+FrameStream::FrameStream(int fd): buffer_(fd), out_(&buffer_), frames_(0)
+{
+#ifdef _MSC_VER
+    // no newline translation in the middle of pixel data
+    _setmode(fd, _O_BINARY);
+#endif
+}
+
+bool FrameStream::write(TGAImage& frame, ImageEncoder& encoder)
+{
+    if (!encoder.encode(frame, out_) || !out_.flush())
+    {
+        return false;
+    }
+    frames_++;
+    return true;
+}
+
+int FrameStream::frames()
+{
+    return frames_;
+}
@@ -0,0 +1,54 @@
+﻿#pragma once
+#include <ostream>
+#include <streambuf>
+#include <vector>
+#include "imageencoder.h"
+#include "tgaimage.h"
+
+/**
+ * \brief std::streambuf writing straight to a file descriptor, so encoders can target stdout or a pipe
+ * handed over by the parent process without going through a file
+ */
+class FdStreamBuf : public std::streambuf
+{
+public:
+    explicit FdStreamBuf(int fd, size_t buffer_size = 1 << 16);
+    ~FdStreamBuf() override;
+
+    FdStreamBuf(const FdStreamBuf&) = delete;
+    FdStreamBuf& operator=(const FdStreamBuf&) = delete;
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    // write all of [p, p + n), retrying partial writes
+    bool write_all(const char* p, size_t n);
+
+    int fd_;
+    std::vector<char> buffer_;
+};
+
+/**
+ * \brief Continuous sequence of encoded frames on a file descriptor, e.g. raw RGB24 on stdout feeding a video
+ * encoder. Each frame is flushed once written, so the reader sees it as soon as it's done.
+ */
+class FrameStream
+{
+public:
+    /**
+     * \param fd Descriptor to write to, 1 for stdout. Switched to binary mode where that matters.
+     */
+    explicit FrameStream(int fd);
+
+    bool write(TGAImage& frame, ImageEncoder& encoder);
+
+    int frames();
+
+private:
+    FdStreamBuf buffer_;
+    std::ostream out_;
+    int frames_;
+};
@@ -1,6 +1,7 @@
 #include "geometry.h"
 
 #include <assert.h>
+#include <algorithm>
 
 template <>
 template <>
@@ -50,11 +51,17 @@ std::vector<float>& Matrix::operator[](const int i)
     return m[i];
 }
 
-Matrix Matrix::operator*(const Matrix& a)
+const std::vector<float>& Matrix::operator[](const int i) const
+{
+    assert(i >= 0 && i < rows);
+    return m[i];
+}
+
+Matrix Matrix::operator*(const Matrix& a) const
 {
     // Make sure two matrix can do multiplication
     assert(cols == a.rows);
-    Matrix res(rows, a.rows);
+    Matrix res(rows, a.cols);
     for (int i = 0; i < rows; ++i)
     {
         for (int j = 0; j < a.cols; ++j)
@@ -69,7 +76,7 @@ Matrix Matrix::operator*(const Matrix& a)
     return res;
 }
 
-Matrix Matrix::transpose()
+Matrix Matrix::transpose() const
 {
     Matrix result(cols, rows);
     for (int i = 0; i < rows; i++)
@@ -78,52 +85,72 @@ Matrix Matrix::transpose()
     return result;
 }
 
-Matrix Matrix::inverse()
+Matrix Matrix::inverse() const
 {
-    assert(rows==cols);
-    // augmenting the square matrix with the identity matrix of the same dimensions a => [ai]
-    Matrix result(rows, cols * 2);
-    for (int i = 0; i < rows; i++)
-        for (int j = 0; j < cols; j++)
-            result[i][j] = m[i][j];
-    for (int i = 0; i < rows; i++)
-        result[i][i + cols] = 1;
-    // first pass
-    for (int i = 0; i < rows - 1; i++)
+    assert(rows == cols);
+    if (rows == 4)
     {
-        // normalize the first row
-        for (int j = result.cols - 1; j >= 0; j--)
-            result[i][j] /= result[i][i];
-        for (int k = i + 1; k < rows; k++)
+        return Matrix4(*this).inverse().to_matrix();
+    }
+    if (rows == 3)
+    {
+        return Matrix3(*this).inverse().to_matrix();
+    }
+
+    // Gauss-Jordan in place: each step turns column k into the matching column of the inverse
+    const int MAX_DIMENSIONS = 16;
+    assert(rows <= MAX_DIMENSIONS);
+    int swaps[MAX_DIMENSIONS];
+    Matrix result = *this;
+    std::vector<std::vector<float>>& a = result.m;
+    const int n = rows;
+    for (int k = 0; k < n; ++k)
+    {
+        // partial pivoting, the largest remaining entry of the column keeps the error bounded
+        int pivot = k;
+        for (int i = k + 1; i < n; ++i)
         {
-            float coeff = result[k][i];
-            for (int j = 0; j < result.cols; j++)
+            if (std::fabs(a[i][k]) > std::fabs(a[pivot][k]))
+            {
+                pivot = i;
+            }
+        }
+        swaps[k] = pivot;
+        // swapping the row vectors only exchanges their buffers
+        a[k].swap(a[pivot]);
+
+        const float inv = 1.f / a[k][k];
+        a[k][k] = 1.f;
+        for (int j = 0; j < n; ++j)
+        {
+            a[k][j] *= inv;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (i == k)
+            {
+                continue;
+            }
+            const float f = a[i][k];
+            a[i][k] = 0.f;
+            for (int j = 0; j < n; ++j)
             {
-                result[k][j] -= result[i][j] * coeff;
+                a[i][j] -= f * a[k][j];
             }
         }
     }
-    // normalize the last row
-    for (int j = result.cols - 1; j >= rows - 1; j--)
-        result[rows - 1][j] /= result[rows - 1][rows - 1];
-    // second pass
-    for (int i = rows - 1; i > 0; i--)
+    // the row swaps of the input are column swaps of the inverse, undone in reverse order
+    for (int k = n - 1; k >= 0; --k)
     {
-        for (int k = i - 1; k >= 0; k--)
+        if (swaps[k] != k)
         {
-            float coeff = result[k][i];
-            for (int j = 0; j < result.cols; j++)
+            for (int i = 0; i < n; ++i)
             {
-                result[k][j] -= result[i][j] * coeff;
+                std::swap(a[i][k], a[i][swaps[k]]);
             }
         }
     }
-    // cut the identity matrix back
-    Matrix truncate(rows, cols);
-    for (int i = 0; i < rows; i++)
-        for (int j = 0; j < cols; j++)
-            truncate[i][j] = result[i][j + cols];
-    return truncate;
+    return result;
 }
 
 std::ostream& operator<<(std::ostream& s, Matrix& m)
@@ -139,3 +166,345 @@ std::ostream& operator<<(std::ostream& s, Matrix& m)
     }
     return s;
 }
+
+Matrix4::Matrix4()
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            m[i][j] = (i == j ? 1.f : 0.f);
+        }
+    }
+}
+
+Matrix4::Matrix4(const Matrix& matrix)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            m[i][j] = matrix[i][j];
+        }
+    }
+}
+
+Matrix Matrix4::to_matrix() const
+{
+    Matrix result(4, 4);
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            result[i][j] = m[i][j];
+        }
+    }
+    return result;
+}
+
+Matrix4 Matrix4::operator*(const Matrix4& a) const
+{
+    Matrix4 result;
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            result.m[i][j] = m[i][0] * a.m[0][j] + m[i][1] * a.m[1][j] + m[i][2] * a.m[2][j] + m[i][3] * a.m[3][j];
+        }
+    }
+    return result;
+}
+
+Matrix4 Matrix4::transpose() const
+{
+    Matrix4 result;
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            result.m[j][i] = m[i][j];
+        }
+    }
+    return result;
+}
+
+namespace
+{
+    /**
+     * \brief 2x2 minors of the top two rows (s) and the bottom two rows (c) of a 4x4 matrix, the determinant and
+     * every cofactor are sums of their products
+     */
+    struct Minors4
+    {
+        explicit Minors4(const float (&a)[4][4])
+        {
+            s[0] = a[0][0] * a[1][1] - a[1][0] * a[0][1];
+            s[1] = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+            s[2] = a[0][0] * a[1][3] - a[1][0] * a[0][3];
+            s[3] = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+            s[4] = a[0][1] * a[1][3] - a[1][1] * a[0][3];
+            s[5] = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+
+            c[0] = a[2][0] * a[3][1] - a[3][0] * a[2][1];
+            c[1] = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+            c[2] = a[2][0] * a[3][3] - a[3][0] * a[2][3];
+            c[3] = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+            c[4] = a[2][1] * a[3][3] - a[3][1] * a[2][3];
+            c[5] = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+        }
+
+        float determinant() const
+        {
+            return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+        }
+
+        float s[6];
+        float c[6];
+    };
+}
+
+float Matrix4::determinant() const
+{
+    return Minors4(m).determinant();
+}
+
+Matrix4 Matrix4::inverse() const
+{
+    const Minors4 minors(m);
+    const float* s = minors.s;
+    const float* c = minors.c;
+    const float inv = 1.f / minors.determinant();
+    const float (&a)[4][4] = m;
+
+    Matrix4 r;
+    r.m[0][0] = (a[1][1] * c[5] - a[1][2] * c[4] + a[1][3] * c[3]) * inv;
+    r.m[0][1] = (-a[0][1] * c[5] + a[0][2] * c[4] - a[0][3] * c[3]) * inv;
+    r.m[0][2] = (a[3][1] * s[5] - a[3][2] * s[4] + a[3][3] * s[3]) * inv;
+    r.m[0][3] = (-a[2][1] * s[5] + a[2][2] * s[4] - a[2][3] * s[3]) * inv;
+
+    r.m[1][0] = (-a[1][0] * c[5] + a[1][2] * c[2] - a[1][3] * c[1]) * inv;
+    r.m[1][1] = (a[0][0] * c[5] - a[0][2] * c[2] + a[0][3] * c[1]) * inv;
+    r.m[1][2] = (-a[3][0] * s[5] + a[3][2] * s[2] - a[3][3] * s[1]) * inv;
+    r.m[1][3] = (a[2][0] * s[5] - a[2][2] * s[2] + a[2][3] * s[1]) * inv;
+
+    r.m[2][0] = (a[1][0] * c[4] - a[1][1] * c[2] + a[1][3] * c[0]) * inv;
+    r.m[2][1] = (-a[0][0] * c[4] + a[0][1] * c[2] - a[0][3] * c[0]) * inv;
+    r.m[2][2] = (a[3][0] * s[4] - a[3][1] * s[2] + a[3][3] * s[0]) * inv;
+    r.m[2][3] = (-a[2][0] * s[4] + a[2][1] * s[2] - a[2][3] * s[0]) * inv;
+
+    r.m[3][0] = (-a[1][0] * c[3] + a[1][1] * c[1] - a[1][2] * c[0]) * inv;
+    r.m[3][1] = (a[0][0] * c[3] - a[0][1] * c[1] + a[0][2] * c[0]) * inv;
+    r.m[3][2] = (-a[3][0] * s[3] + a[3][1] * s[1] - a[3][2] * s[0]) * inv;
+    r.m[3][3] = (a[2][0] * s[3] - a[2][1] * s[1] + a[2][2] * s[0]) * inv;
+    return r;
+}
+
+Matrix4 Matrix4::inverse_transpose() const
+{
+    return inverse().transpose();
+}
+
+Matrix3::Matrix3()
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            m[i][j] = (i == j ? 1.f : 0.f);
+        }
+    }
+}
+
+Matrix3::Matrix3(const Matrix4& transform)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            m[i][j] = transform.m[i][j];
+        }
+    }
+}
+
+Matrix3::Matrix3(const Matrix& matrix)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            m[i][j] = matrix[i][j];
+        }
+    }
+}
+
+Matrix Matrix3::to_matrix() const
+{
+    Matrix result(3, 3);
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            result[i][j] = m[i][j];
+        }
+    }
+    return result;
+}
+
+Matrix3 Matrix3::transpose() const
+{
+    Matrix3 result;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            result.m[j][i] = m[i][j];
+        }
+    }
+    return result;
+}
+
+float Matrix3::determinant() const
+{
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) + m[0][1] * (m[1][2] * m[2][0] - m[1][0] * m[2][2]) +
+        m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+Matrix3 Matrix3::inverse_transpose() const
+{
+    Matrix3 r;
+    r.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    r.m[0][1] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    r.m[0][2] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    r.m[1][0] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+    r.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+    r.m[1][2] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+    r.m[2][0] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+    r.m[2][1] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+    r.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+    // expanding along the first row reuses its cofactors
+    const float inv = 1.f / (m[0][0] * r.m[0][0] + m[0][1] * r.m[0][1] + m[0][2] * r.m[0][2]);
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            r.m[i][j] *= inv;
+        }
+    }
+    return r;
+}
+
+Matrix3 Matrix3::inverse() const
+{
+    return inverse_transpose().transpose();
+}
+
+Vec3f m2v(Matrix m)
+{
+    return Vec3f(m[0][0] / m[3][0], m[1][0] / m[3][0], m[2][0] / m[3][0]);
+}
+
+Matrix v2m(Vec3f v)
+{
+    Matrix m(4, 1);
+    m[0][0] = v.x;
+    m[1][0] = v.y;
+    m[2][0] = v.z;
+    m[3][0] = 1.f;
+    return m;
+}
+
+Matrix lookat(Vec3f eye, Vec3f center, Vec3f up)
+{
+    Vec3f z = (eye - center).normalize();
+    Vec3f x = (up ^ z).normalize();
+    Vec3f y = (z ^ x).normalize();
+    Matrix res = Matrix::identity(4);
+    for (int i = 0; i < 3; ++i)
+    {
+        res[0][i] = x[i];
+        res[1][i] = y[i];
+        res[2][i] = z[i];
+    }
+    res[0][3] = -(x * center);
+    res[1][3] = -(y * center);
+    res[2][3] = -(z * center);
+    return res;
+}
+
+Matrix translation(Vec3f t)
+{
+    Matrix res = Matrix::identity(4);
+    for (int i = 0; i < 3; ++i)
+    {
+        res[i][3] = t[i];
+    }
+    return res;
+}
+
+Matrix rotation(Vec3f angles)
+{
+    Matrix rx = Matrix::identity(4);
+    rx[1][1] = rx[2][2] = std::cos(angles.x);
+    rx[2][1] = std::sin(angles.x);
+    rx[1][2] = -rx[2][1];
+
+    Matrix ry = Matrix::identity(4);
+    ry[0][0] = ry[2][2] = std::cos(angles.y);
+    ry[0][2] = std::sin(angles.y);
+    ry[2][0] = -ry[0][2];
+
+    Matrix rz = Matrix::identity(4);
+    rz[0][0] = rz[1][1] = std::cos(angles.z);
+    rz[1][0] = std::sin(angles.z);
+    rz[0][1] = -rz[1][0];
+
+    return rz * (ry * rx);
+}
+
+Matrix scaling(float s)
+{
+    Matrix res = Matrix::identity(4);
+    for (int i = 0; i < 3; ++i)
+    {
+        res[i][i] = s;
+    }
+    return res;
+}
+
+Matrix viewport(int x, int y, int w, int h, int depth)
+{
+    Matrix m = Matrix::identity(4);
+    m[0][3] = x + w / 2.f;
+    m[1][3] = y + h / 2.f;
+    m[2][3] = depth / 2.f;
+
+    m[0][0] = w / 2.f;
+    m[1][1] = h / 2.f;
+    m[2][2] = depth / 2.f;
+    return m;
+}
+
+void screen_ray(const Matrix& transform, float x, float y, Vec3f& orig, Vec3f& dir)
+{
+    Matrix m = transform;
+    Matrix inv = m.inverse();
+    Vec3f onray = m2v(inv * v2m(Vec3f(x, y, 0.f)));
+    // the eye is the point screen space w vanishes at
+    Matrix h(4, 1);
+    h[2][0] = 1.f;
+    Matrix eye = inv * h;
+    if (std::fabs(eye[3][0]) > 1e-6f)
+    {
+        orig = Vec3f(eye[0][0], eye[1][0], eye[2][0]) * (1.f / eye[3][0]);
+        dir = onray - orig;
+        return;
+    }
+
+    // orthographic, every ray is parallel
+    dir = Vec3f(eye[0][0], eye[1][0], eye[2][0]);
+    if (m2v(m * v2m(onray + dir)).z > 0.f)
+    {
+        dir = dir * -1;
+    }
+    orig = onray - dir * 1e4f;
+}
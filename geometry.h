@@ -1,4 +1,6 @@
 ﻿#pragma once
+#include <cmath>
+#include <limits>
 #include <ostream>
 #include <vector>
 
@@ -189,12 +191,137 @@ public:
 
     static Matrix identity(int dimensions);
     std::vector<float>& operator[](const int i);
-    Matrix operator*(const Matrix& a);
-    Matrix transpose();
-    Matrix inverse();
+    const std::vector<float>& operator[](const int i) const;
+    Matrix operator*(const Matrix& a) const;
+    Matrix transpose() const;
+
+    /**
+     * \brief Inverse of a square matrix. 3x3 and 4x4 go through the closed forms of Matrix3 and Matrix4, other sizes
+     * through in-place Gauss-Jordan elimination with partial pivoting; neither needs memory besides the result.
+     * Singular matrices come back with infinite or NaN entries.
+     */
+    Matrix inverse() const;
 
     friend std::ostream& operator<<(std::ostream& s, Matrix& m);
 private:
     std::vector<std::vector<float>> m;
     int rows, cols;
 };
+
+/**
+ * \brief Smallest w a vertex may project with. Perspective transforms give w = 1 at the camera's center and 0 at the
+ * eye, so this puts the near plane a tenth of the way from the eye to center; closer points would blow up.
+ */
+const float NEAR_W = 0.1f;
+
+/**
+ * \brief z of the screen points Matrix4::project_screen() rejects, the rasterizer drops their triangles and lines
+ */
+const int BEHIND_EYE = std::numeric_limits<int>::min();
+
+/**
+ * \brief Fixed size copy of a 4x4 Matrix for the per-vertex and per-instance paths, nothing allocates
+ */
+struct Matrix4
+{
+    Matrix4();
+    explicit Matrix4(const Matrix& matrix);
+
+    Matrix to_matrix() const;
+
+    Matrix4 operator*(const Matrix4& a) const;
+    Matrix4 transpose() const;
+    float determinant() const;
+
+    // closed form through the 2x2 minors, singular matrices give infinite or NaN entries
+    Matrix4 inverse() const;
+    Matrix4 inverse_transpose() const;
+
+    // same result as m2v(matrix * v2m(v))
+    inline Vec3f project(const Vec3f& v) const
+    {
+        float r[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            r[i] = m[i][0] * v.x + m[i][1] * v.y + m[i][2] * v.z + m[i][3];
+        }
+        return Vec3f(r[0] / r[3], r[1] / r[3], r[2] / r[3]);
+    }
+
+    // project() to screen coordinates, z is BEHIND_EYE when w is below NEAR_W
+    inline Vec3i project_screen(const Vec3f& v) const
+    {
+        const float w = m[3][0] * v.x + m[3][1] * v.y + m[3][2] * v.z + m[3][3];
+        if (w < NEAR_W)
+        {
+            return Vec3i(0, 0, BEHIND_EYE);
+        }
+        return project(v);
+    }
+
+    float m[4][4];
+};
+
+/**
+ * \brief Fixed size 3x3 matrix, e.g. the linear part of a transform for directions and normals
+ */
+struct Matrix3
+{
+    Matrix3();
+    // upper left 3x3 of a 4x4 transform
+    explicit Matrix3(const Matrix4& transform);
+    explicit Matrix3(const Matrix& matrix);
+
+    Matrix to_matrix() const;
+
+    inline Vec3f operator*(const Vec3f& v) const
+    {
+        return Vec3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                     m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                     m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    Matrix3 transpose() const;
+    float determinant() const;
+
+    // closed form through the cofactors, singular matrices give infinite or NaN entries
+    Matrix3 inverse() const;
+
+    /**
+     * \brief Transforms normals along with the points the matrix transforms, the cofactor matrix over the determinant
+     */
+    Matrix3 inverse_transpose() const;
+
+    float m[3][3];
+};
+
+// homogeneous column matrix (4x1) back to a point, dividing by w
+Vec3f m2v(Matrix m);
+
+// point to homogeneous column matrix (4x1) with w = 1
+Matrix v2m(Vec3f v);
+
+/**
+ * \brief View matrix looking from eye at center, the scene is rotated about center
+ */
+Matrix lookat(Vec3f eye, Vec3f center, Vec3f up);
+
+Matrix translation(Vec3f t);
+
+/**
+ * \brief Rotation by euler angles in radians, applied about x, then y, then z
+ */
+Matrix rotation(Vec3f angles);
+
+Matrix scaling(float s);
+
+/**
+ * \brief Maps x and y from [-1, 1] to the w x h rectangle at (x, y), and z from [-1, 1] to [0, depth]
+ */
+Matrix viewport(int x, int y, int w, int h, int depth);
+
+/**
+ * \brief Object space ray through screen point (x, y) of an object to screen transform, pointing away from the viewer.
+ * For perspective transforms it starts at the eye, for orthographic ones far in front of the scene.
+ */
+void screen_ray(const Matrix& transform, float x, float y, Vec3f& orig, Vec3f& dir);
@@ -0,0 +1,589 @@
+﻿#include "imageencoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+    // zlib's 32K window and deflate's match length limits
+    const int DEFLATE_WINDOW = 32768;
+    const int DEFLATE_MIN_MATCH = 3;
+    const int DEFLATE_MAX_MATCH = 258;
+    const int DEFLATE_HASH_BITS = 15;
+    // largest stored block
+    const int DEFLATE_STORED_MAX = 65535;
+
+    const int LENGTH_BASE[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    const int DIST_BASE[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+        6145, 8193, 12289, 16385, 24577
+    };
+    const int DIST_EXTRA[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    /**
+     * \brief Tables built once: the CRC-32 table, the fixed Huffman codes already bit reversed for the LSB-first
+     * bit writer, and the length to length-code map
+     */
+    struct DeflateTables
+    {
+        DeflateTables()
+        {
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                {
+                    c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                crc[n] = c;
+            }
+            for (int sym = 0; sym < 288; ++sym)
+            {
+                int code;
+                int len;
+                if (sym < 144)
+                {
+                    code = 0x30 + sym;
+                    len = 8;
+                }
+                else if (sym < 256)
+                {
+                    code = 0x190 + sym - 144;
+                    len = 9;
+                }
+                else if (sym < 280)
+                {
+                    code = sym - 256;
+                    len = 7;
+                }
+                else
+                {
+                    code = 0xc0 + sym - 280;
+                    len = 8;
+                }
+                litcode[sym] = reverse(code, len);
+                litlen[sym] = len;
+            }
+            for (int d = 0; d < 30; ++d)
+            {
+                distcode[d] = reverse(d, 5);
+            }
+            for (int c = 0; c < 29; ++c)
+            {
+                for (int len = LENGTH_BASE[c]; len < LENGTH_BASE[c] + (1 << LENGTH_EXTRA[c]) && len <= 258; ++len)
+                {
+                    lengthcode[len] = c;
+                }
+            }
+        }
+
+        static uint32_t reverse(uint32_t code, int len)
+        {
+            uint32_t r = 0;
+            for (int i = 0; i < len; ++i)
+            {
+                r = (r << 1) | ((code >> i) & 1);
+            }
+            return r;
+        }
+
+        uint32_t crc[256];
+        uint32_t litcode[288];
+        int litlen[288];
+        uint32_t distcode[30];
+        int lengthcode[259];
+    };
+
+    const DeflateTables& tables()
+    {
+        static const DeflateTables t;
+        return t;
+    }
+
+    uint32_t crc32(uint32_t crc, const unsigned char* p, size_t n)
+    {
+        const uint32_t* table = tables().crc;
+        crc = ~crc;
+        for (size_t i = 0; i < n; ++i)
+        {
+            crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    uint32_t adler32(const unsigned char* p, size_t n)
+    {
+        // 5552 is the most bytes that can be summed before the 32 bit sums may overflow
+        uint32_t a = 1;
+        uint32_t b = 0;
+        while (n > 0)
+        {
+            size_t block = std::min(n, (size_t)5552);
+            n -= block;
+            for (size_t i = 0; i < block; ++i)
+            {
+                a += p[i];
+                b += a;
+            }
+            p += block;
+            a %= 65521;
+            b %= 65521;
+        }
+        return (b << 16) | a;
+    }
+
+    /**
+     * \brief Appends bits least significant first, the order deflate packs them in
+     */
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<unsigned char>& out): out_(out), bits_(0), nbits_(0)
+        {
+        }
+
+        inline void put(uint32_t value, int n)
+        {
+            bits_ |= (uint64_t)value << nbits_;
+            nbits_ += n;
+            while (nbits_ >= 8)
+            {
+                out_.push_back((unsigned char)bits_);
+                bits_ >>= 8;
+                nbits_ -= 8;
+            }
+        }
+
+        // pad to a byte boundary
+        void align()
+        {
+            if (nbits_ > 0)
+            {
+                put(0, 8 - nbits_);
+            }
+        }
+
+    private:
+        std::vector<unsigned char>& out_;
+        uint64_t bits_;
+        int nbits_;
+    };
+
+    void deflate_stored(const unsigned char* src, size_t n, std::vector<unsigned char>& out)
+    {
+        BitWriter bits(out);
+        size_t pos = 0;
+        do
+        {
+            size_t len = std::min(n - pos, (size_t)DEFLATE_STORED_MAX);
+            bits.put(pos + len == n ? 1 : 0, 1);
+            bits.put(0, 2);
+            bits.align();
+            out.push_back((unsigned char)len);
+            out.push_back((unsigned char)(len >> 8));
+            out.push_back((unsigned char)~len);
+            out.push_back((unsigned char)(~len >> 8));
+            out.insert(out.end(), src + pos, src + pos + len);
+            pos += len;
+        }
+        while (pos < n);
+    }
+
+    inline uint32_t hash3(const unsigned char* p)
+    {
+        uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+    }
+
+    /**
+     * \brief One fixed Huffman block. Each position looks up the last position with the same three bytes and takes
+     * that match if it is in the window, no chains and no lazy matching.
+     */
+    void deflate_fixed(const unsigned char* src, size_t n, std::vector<unsigned char>& out)
+    {
+        const DeflateTables& t = tables();
+        BitWriter bits(out);
+        bits.put(1, 1);
+        bits.put(1, 2);
+
+        std::vector<int> head(1 << DEFLATE_HASH_BITS, -1);
+        size_t pos = 0;
+        while (pos < n)
+        {
+            int len = 0;
+            int dist = 0;
+            if (pos + DEFLATE_MIN_MATCH <= n)
+            {
+                uint32_t h = hash3(src + pos);
+                int candidate = head[h];
+                head[h] = (int)pos;
+                if (candidate >= 0 && (int)pos - candidate <= DEFLATE_WINDOW)
+                {
+                    const unsigned char* a = src + candidate;
+                    const unsigned char* b = src + pos;
+                    const int limit = (int)std::min(n - pos, (size_t)DEFLATE_MAX_MATCH);
+                    while (len < limit && a[len] == b[len])
+                    {
+                        ++len;
+                    }
+                    dist = (int)pos - candidate;
+                }
+            }
+
+            if (len < DEFLATE_MIN_MATCH)
+            {
+                bits.put(t.litcode[src[pos]], t.litlen[src[pos]]);
+                ++pos;
+                continue;
+            }
+
+            const int lc = t.lengthcode[len];
+            bits.put(t.litcode[257 + lc], t.litlen[257 + lc]);
+            bits.put(len - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+            const int dc = (int)(std::upper_bound(DIST_BASE, DIST_BASE + 30, dist) - DIST_BASE) - 1;
+            bits.put(t.distcode[dc], 5);
+            bits.put(dist - DIST_BASE[dc], DIST_EXTRA[dc]);
+
+            // the matched positions go into the table too so later data can refer to them
+            const size_t end = pos + len;
+            for (++pos; pos < end && pos + DEFLATE_MIN_MATCH <= n; ++pos)
+            {
+                head[hash3(src + pos)] = (int)pos;
+            }
+            pos = end;
+        }
+        bits.put(t.litcode[256], t.litlen[256]);
+        bits.align();
+    }
+
+    void put_be32(std::vector<unsigned char>& out, uint32_t v)
+    {
+        out.push_back((unsigned char)(v >> 24));
+        out.push_back((unsigned char)(v >> 16));
+        out.push_back((unsigned char)(v >> 8));
+        out.push_back((unsigned char)v);
+    }
+
+    void write_chunk(std::ostream& out, const char* type, const std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> head;
+        put_be32(head, (uint32_t)data.size());
+        head.insert(head.end(), type, type + 4);
+        uint32_t crc = crc32(0, head.data() + 4, 4);
+        crc = crc32(crc, data.data(), data.size());
+        std::vector<unsigned char> tail;
+        put_be32(tail, crc);
+        out.write((const char*)head.data(), head.size());
+        out.write((const char*)data.data(), data.size());
+        out.write((const char*)tail.data(), tail.size());
+    }
+
+    inline int paeth(int a, int b, int c)
+    {
+        const int p = a + b - c;
+        const int pa = abs(p - a);
+        const int pb = abs(p - b);
+        const int pc = abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+
+    /**
+     * \brief Row y counted from the top in file channel order: RGB(A) instead of the BGR(A) kept in memory,
+     * alpha dropped unless keep_alpha
+     */
+    void file_row(TGAImage& image, int y, bool keep_alpha, unsigned char* out)
+    {
+        const int width = image.get_width();
+        const int bytespp = image.get_bytespp();
+        const unsigned char* src = image.buffer() + (size_t)(image.get_height() - 1 - y) * width * bytespp;
+        if (bytespp == TGAImage::GRAYSCALE)
+        {
+            std::copy(src, src + width, out);
+            return;
+        }
+        const int channels = keep_alpha ? bytespp : 3;
+        for (int x = 0; x < width; ++x, src += bytespp, out += channels)
+        {
+            out[0] = src[2];
+            out[1] = src[1];
+            out[2] = src[0];
+            if (channels == 4)
+            {
+                out[3] = src[3];
+            }
+        }
+    }
+}
+
+ImageEncoder* ImageEncoder::for_format(std::string name)
+{
+    static TgaEncoder tga;
+    static PnmEncoder pnm;
+    static PfmEncoder pfm;
+    static PngEncoder png;
+    static RawEncoder rgb(false);
+    static RawEncoder rgba(true);
+    if (!name.empty() && name[0] == '.')
+    {
+        name = name.substr(1);
+    }
+    if (name == "tga")
+    {
+        return &tga;
+    }
+    if (name == "ppm" || name == "pgm" || name == "pnm")
+    {
+        return &pnm;
+    }
+    if (name == "pfm")
+    {
+        return &pfm;
+    }
+    if (name == "png")
+    {
+        return &png;
+    }
+    if (name == "rgb24" || name == "rgb")
+    {
+        return &rgb;
+    }
+    if (name == "rgba")
+    {
+        return &rgba;
+    }
+    return nullptr;
+}
+
+const char* TgaEncoder::extension()
+{
+    return ".tga";
+}
+
+bool TgaEncoder::encode(TGAImage& image, std::ostream& out)
+{
+    return image.write_tga(out, rle_);
+}
+
+const char* PnmEncoder::extension()
+{
+    return ".ppm";
+}
+
+bool PnmEncoder::encode(TGAImage& image, std::ostream& out)
+{
+    const int width = image.get_width();
+    const int height = image.get_height();
+    const int channels = image.get_bytespp() == TGAImage::GRAYSCALE ? 1 : 3;
+    char header[64];
+    int n = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", channels == 1 ? 5 : 6, width, height);
+    out.write(header, n);
+    std::vector<unsigned char> row((size_t)width * channels);
+    for (int y = 0; y < height; ++y)
+    {
+        file_row(image, y, false, row.data());
+        out.write((const char*)row.data(), row.size());
+    }
+    if (!out.good())
+    {
+        std::cerr << "can't dump the pnm file\n";
+        return false;
+    }
+    return true;
+}
+
+const char* RawEncoder::extension()
+{
+    return alpha_ ? ".rgba" : ".rgb";
+}
+
+bool RawEncoder::encode(TGAImage& image, std::ostream& out)
+{
+    const int width = image.get_width();
+    const int height = image.get_height();
+    const int bytespp = image.get_bytespp();
+    const int channels = alpha_ ? 4 : 3;
+    std::vector<unsigned char> row((size_t)width * channels);
+    std::vector<unsigned char> pixels((size_t)width * bytespp);
+    for (int y = 0; y < height; ++y)
+    {
+        if (bytespp == channels)
+        {
+            file_row(image, y, alpha_, row.data());
+        }
+        else
+        {
+            // gray, or RGB without the alpha that was asked for
+            file_row(image, y, true, pixels.data());
+            for (int x = 0; x < width; ++x)
+            {
+                const unsigned char* src = pixels.data() + x * bytespp;
+                unsigned char* dst = row.data() + x * channels;
+                dst[0] = src[0];
+                dst[1] = bytespp == TGAImage::GRAYSCALE ? src[0] : src[1];
+                dst[2] = bytespp == TGAImage::GRAYSCALE ? src[0] : src[2];
+                if (alpha_)
+                {
+                    dst[3] = 255;
+                }
+            }
+        }
+        out.write((const char*)row.data(), row.size());
+    }
+    if (!out.good())
+    {
+        std::cerr << "can't dump the raw frame\n";
+        return false;
+    }
+    return true;
+}
+
+const char* PfmEncoder::extension()
+{
+    return ".pfm";
+}
+
+bool PfmEncoder::encode(TGAImage& image, std::ostream& out)
+{
+    const int width = image.get_width();
+    const int height = image.get_height();
+    const int bytespp = image.get_bytespp();
+    const int channels = bytespp == TGAImage::GRAYSCALE ? 1 : 3;
+    // the image is stored bottom row first like PFM, only BGR needs turning into RGB
+    std::vector<float> values((size_t)width * height * channels);
+    const unsigned char* src = image.buffer();
+    float* dst = values.data();
+    for (size_t i = 0; i < (size_t)width * height; ++i, src += bytespp, dst += channels)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            dst[c] = src[channels == 1 ? 0 : 2 - c] * (1.f / 255.f);
+        }
+    }
+    return write_pfm(out, values.data(), width, height, channels);
+}
+
+const char* PngEncoder::extension()
+{
+    return ".png";
+}
+
+bool PngEncoder::encode(TGAImage& image, std::ostream& out)
+{
+    const int width = image.get_width();
+    const int height = image.get_height();
+    const int channels = image.get_bytespp();
+    const size_t stride = (size_t)width * channels;
+
+    // filtered scanlines, each prefixed by its filter type
+    std::vector<unsigned char> raw((stride + 1) * height);
+    std::vector<unsigned char> prev(stride, 0);
+    std::vector<unsigned char> cur(stride);
+    std::vector<unsigned char> candidate[5];
+    for (int f = 0; f < 5; ++f)
+    {
+        candidate[f].resize(stride);
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        file_row(image, y, true, cur.data());
+        unsigned char* dst = raw.data() + y * (stride + 1);
+        if (level_ <= 0)
+        {
+            dst[0] = 0;
+            std::copy(cur.begin(), cur.end(), dst + 1);
+            continue;
+        }
+
+        for (size_t i = 0; i < stride; ++i)
+        {
+            const int x = cur[i];
+            const int a = i >= (size_t)channels ? cur[i - channels] : 0;
+            const int b = prev[i];
+            const int c = i >= (size_t)channels ? prev[i - channels] : 0;
+            candidate[0][i] = (unsigned char)x;
+            candidate[1][i] = (unsigned char)(x - a);
+            candidate[2][i] = (unsigned char)(x - b);
+            candidate[3][i] = (unsigned char)(x - ((a + b) >> 1));
+            candidate[4][i] = (unsigned char)(x - paeth(a, b, c));
+        }
+        // the usual heuristic: bytes read as signed, smallest total magnitude compresses best
+        int best = 0;
+        long bestsum = -1;
+        for (int f = 0; f < 5; ++f)
+        {
+            long sum = 0;
+            for (size_t i = 0; i < stride; ++i)
+            {
+                sum += abs((int)(signed char)candidate[f][i]);
+            }
+            if (bestsum < 0 || sum < bestsum)
+            {
+                best = f;
+                bestsum = sum;
+            }
+        }
+        dst[0] = (unsigned char)best;
+        std::copy(candidate[best].begin(), candidate[best].end(), dst + 1);
+        std::swap(prev, cur);
+    }
+
+    // zlib stream: header for the fastest level, deflate data, adler32 of the uncompressed bytes
+    std::vector<unsigned char> idat;
+    idat.reserve(raw.size() / 2 + 64);
+    idat.push_back(0x78);
+    idat.push_back(0x01);
+    if (level_ <= 0)
+    {
+        deflate_stored(raw.data(), raw.size(), idat);
+    }
+    else
+    {
+        deflate_fixed(raw.data(), raw.size(), idat);
+    }
+    put_be32(idat, adler32(raw.data(), raw.size()));
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    static const unsigned char color_types[5] = {0, 0, 0, 2, 6};
+    std::vector<unsigned char> ihdr;
+    put_be32(ihdr, width);
+    put_be32(ihdr, height);
+    ihdr.push_back(8);
+    ihdr.push_back(color_types[channels]);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    out.write((const char*)signature, sizeof(signature));
+    write_chunk(out, "IHDR", ihdr);
+    write_chunk(out, "IDAT", idat);
+    write_chunk(out, "IEND", std::vector<unsigned char>());
+    if (!out.good())
+    {
+        std::cerr << "can't dump the png file\n";
+        return false;
+    }
+    return true;
+}
+
+bool write_pfm(std::ostream& out, const float* data, int width, int height, int channels)
+{
+    // a negative scale marks little-endian samples
+    char header[64];
+    int n = snprintf(header, sizeof(header), "P%c\n%d %d\n-1.0\n", channels == 1 ? 'f' : 'F', width, height);
+    out.write(header, n);
+    out.write((const char*)data, (size_t)width * height * channels * sizeof(float));
+    if (!out.good())
+    {
+        std::cerr << "can't dump the pfm file\n";
+        return false;
+    }
+    return true;
+}
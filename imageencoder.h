@@ -0,0 +1,116 @@
+﻿#pragma once
+#include <ostream>
+#include <string>
+#include "tgaimage.h"
+
+/**
+ * \brief Writes a TGAImage in some file format. TGAImage::write_file takes any encoder, for_format picks one of
+ * the built in ones by name.
+ */
+class ImageEncoder
+{
+public:
+    virtual ~ImageEncoder()
+    {
+    }
+
+    /**
+     * \brief File extension of the format, with the dot
+     */
+    virtual const char* extension() = 0;
+
+    virtual bool encode(TGAImage& image, std::ostream& out) = 0;
+
+    /**
+     * \brief Shared encoder for a format name or extension: tga, ppm (pgm for grayscale images), pfm, png,
+     * rgb24 or rgba
+     * \return null for an unknown format
+     */
+    static ImageEncoder* for_format(std::string name);
+};
+
+class TgaEncoder : public ImageEncoder
+{
+public:
+    explicit TgaEncoder(bool rle = true): rle_(rle)
+    {
+    }
+
+    const char* extension() override;
+
+    bool encode(TGAImage& image, std::ostream& out) override;
+
+private:
+    bool rle_;
+};
+
+/**
+ * \brief Binary PPM, or PGM for grayscale images. Uncompressed with a one line header, so other processes can
+ * read frames straight from a pipe. Alpha is dropped.
+ */
+class PnmEncoder : public ImageEncoder
+{
+public:
+    const char* extension() override;
+
+    bool encode(TGAImage& image, std::ostream& out) override;
+};
+
+/**
+ * \brief Headerless RGB24 or RGBA pixels, top row first, the rawvideo layout video encoders read from a pipe.
+ * Grayscale images are expanded to gray RGB.
+ */
+class RawEncoder : public ImageEncoder
+{
+public:
+    explicit RawEncoder(bool alpha = false): alpha_(alpha)
+    {
+    }
+
+    const char* extension() override;
+
+    bool encode(TGAImage& image, std::ostream& out) override;
+
+private:
+    bool alpha_;
+};
+
+/**
+ * \brief Portable float map, values in [0, 1]. Alpha is dropped.
+ */
+class PfmEncoder : public ImageEncoder
+{
+public:
+    const char* extension() override;
+
+    bool encode(TGAImage& image, std::ostream& out) override;
+};
+
+/**
+ * \brief PNG with its own deflate, no zlib needed.
+ * Every row gets the filter with the smallest sum of absolute differences, then the stream is compressed with
+ * one fixed Huffman block fed by a single-probe hash matcher, which is close to zlib's fastest level.
+ */
+class PngEncoder : public ImageEncoder
+{
+public:
+    /**
+     * \param level 0 stores the rows uncompressed, 1 and up run the fast compressor
+     */
+    explicit PngEncoder(int level = 1): level_(level)
+    {
+    }
+
+    const char* extension() override;
+
+    bool encode(TGAImage& image, std::ostream& out) override;
+
+private:
+    int level_;
+};
+
+/**
+ * \brief Write a PFM from float samples stored bottom row first, the order PFM uses
+ * \param channels 1 for a grayscale "Pf" map, 3 for color
+ */
+bool write_pfm(std::ostream& out, const float* data, int width, int height, int channels);
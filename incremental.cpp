@@ -0,0 +1,179 @@
+﻿#include "incremental.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace
+{
+    bool same_matrix(Matrix& a, Matrix& b)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                if (a[i][j] != b[i][j])
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool same_item(FrameGeometry::Item& a, FrameGeometry::Item& b)
+    {
+        return a.model == b.model && same_matrix(a.transform, b.transform) && a.light_dir.x == b.light_dir.x &&
+            a.light_dir.y == b.light_dir.y && a.light_dir.z == b.light_dir.z;
+    }
+}
+
+IncrementalRenderer::IncrementalRenderer(int width, int height)
+    : depth_(width, height),
+      color_(width, height, TGAImage::RGB, &FramePool::frames()),
+      tilesx_((width + DIRTY_TILE - 1) / DIRTY_TILE),
+      tilesy_((height + DIRTY_TILE - 1) / DIRTY_TILE),
+      valid_(false),
+      redrawn_(0)
+{
+    previous_.count = 0;
+    current_.count = 0;
+    dirty_.assign((size_t)tilesx_ * tilesy_, 0);
+}
+
+void IncrementalRenderer::invalidate()
+{
+    valid_ = false;
+}
+
+TGAImage& IncrementalRenderer::color()
+{
+    return color_;
+}
+
+DepthBuffer& IncrementalRenderer::depth()
+{
+    return depth_;
+}
+
+long IncrementalRenderer::redrawn_pixels()
+{
+    return redrawn_;
+}
+
+void IncrementalRenderer::dirty_rects(std::vector<ScreenRect>& rects)
+{
+    const int width = color_.get_width();
+    const int height = color_.get_height();
+    if (!valid_)
+    {
+        rects.push_back(ScreenRect{0, 0, width - 1, height - 1});
+        return;
+    }
+
+    std::fill(dirty_.begin(), dirty_.end(), 0);
+    std::map<const Instance*, int> previous;
+    for (int i = 0; i < previous_.count; ++i)
+    {
+        previous[previous_.items[i].instance] = i;
+    }
+    for (int i = 0; i < current_.count; ++i)
+    {
+        FrameGeometry::Item& item = current_.items[i];
+        auto it = previous.find(item.instance);
+        if (it != previous.end())
+        {
+            FrameGeometry::Item& old = previous_.items[it->second];
+            previous.erase(it);
+            if (same_item(item, old))
+            {
+                continue;
+            }
+            mark(old);
+        }
+        mark(item);
+    }
+    // instances that are gone
+    for (auto& left : previous)
+    {
+        mark(previous_.items[left.second]);
+    }
+
+    // runs of dirty tiles along each row, grown downwards while the rows below have the same run
+    for (int ty = 0; ty < tilesy_; ++ty)
+    {
+        for (int tx = 0; tx < tilesx_; ++tx)
+        {
+            if (!dirty_[tx + ty * tilesx_])
+            {
+                continue;
+            }
+            int tx1 = tx;
+            while (tx1 + 1 < tilesx_ && dirty_[tx1 + 1 + ty * tilesx_])
+            {
+                ++tx1;
+            }
+            int ty1 = ty;
+            while (ty1 + 1 < tilesy_)
+            {
+                const unsigned char* run = dirty_.data() + (ty1 + 1) * tilesx_;
+                if (std::find(run + tx, run + tx1 + 1, 0) != run + tx1 + 1)
+                {
+                    break;
+                }
+                ++ty1;
+            }
+            for (int y = ty; y <= ty1; ++y)
+            {
+                std::fill(dirty_.begin() + y * tilesx_ + tx, dirty_.begin() + y * tilesx_ + tx1 + 1, 0);
+            }
+            rects.push_back(ScreenRect{tx * DIRTY_TILE, ty * DIRTY_TILE, std::min(width, (tx1 + 1) * DIRTY_TILE) - 1,
+                                       std::min(height, (ty1 + 1) * DIRTY_TILE) - 1});
+            tx = tx1;
+        }
+    }
+}
+
+void IncrementalRenderer::mark(FrameGeometry::Item& item)
+{
+    const int width = color_.get_width();
+    const int height = color_.get_height();
+    if (item.bounds.x1 < 0 || item.bounds.y1 < 0 || item.bounds.x0 >= width || item.bounds.y0 >= height)
+    {
+        return;
+    }
+    Model& model = *item.model;
+    for (int i : item.faces)
+    {
+        const Vec3i& a = item.screen[model.vert_index(i, 0)];
+        const Vec3i& b = item.screen[model.vert_index(i, 1)];
+        const Vec3i& c = item.screen[model.vert_index(i, 2)];
+        // the rasterizer drops these
+        if (a.z == BEHIND_EYE || b.z == BEHIND_EYE || c.z == BEHIND_EYE)
+        {
+            continue;
+        }
+        const int tx0 = std::max(0, std::min(a.x, std::min(b.x, c.x))) / DIRTY_TILE;
+        const int ty0 = std::max(0, std::min(a.y, std::min(b.y, c.y))) / DIRTY_TILE;
+        const int tx1 = std::min(width - 1, std::max(a.x, std::max(b.x, c.x))) / DIRTY_TILE;
+        const int ty1 = std::min(height - 1, std::max(a.y, std::max(b.y, c.y))) / DIRTY_TILE;
+        for (int ty = ty0; ty <= ty1; ++ty)
+        {
+            for (int tx = tx0; tx <= tx1; ++tx)
+            {
+                dirty_[tx + ty * tilesx_] = 1;
+            }
+        }
+    }
+}
+
+void IncrementalRenderer::clear(const ScreenRect& rect)
+{
+    depth_.clear(rect);
+    const int bytespp = color_.get_bytespp();
+    const size_t stride = (size_t)color_.get_width() * bytespp;
+    for (int y = rect.y0; y <= rect.y1; ++y)
+    {
+        memset(color_.buffer() + y * stride + rect.x0 * bytespp, 0, (size_t)(rect.x1 - rect.x0 + 1) * bytespp);
+    }
+}
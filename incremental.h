@@ -0,0 +1,70 @@
+﻿#pragma once
+#include <vector>
+#include "framebuffer.h"
+#include "geometry.h"
+#include "scene.h"
+#include "shader.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Renders a sequence of frames into one persistent color and depth buffer and redraws only the parts of
+ * the screen under instances that changed since the previous frame: moved, switched level of detail, lit from
+ * another direction, appeared or disappeared. The tiles under each of their triangles, at the old and the new
+ * position, are cleared and everything overlapping them is rasterized again inside them; the rest of both
+ * buffers is kept.
+ * Changes it can't see, another shader or a new shadow map, need invalidate().
+ */
+class IncrementalRenderer
+{
+public:
+    // side of the squares dirty regions are tracked in, a multiple of DepthBuffer::DEPTH_TILE
+    static const int DIRTY_TILE = 32;
+
+    IncrementalRenderer(int width, int height);
+
+    // redraw the whole frame next time
+    void invalidate();
+
+    template <class Shader>
+    void render(Scene& scene, const Matrix& viewproj, Vec3f light_dir, ShadowMap* shadow = nullptr)
+    {
+        PrepareScene<Shader>(scene, viewproj, light_dir, color_.get_width(), color_.get_height(), current_);
+        std::vector<ScreenRect> rects;
+        dirty_rects(rects);
+        redrawn_ = 0;
+        for (const ScreenRect& rect : rects)
+        {
+            clear(rect);
+            DrawPrepared<Shader>(current_, depth_, color_, shadow, &rect);
+            redrawn_ += (long)(rect.x1 - rect.x0 + 1) * (rect.y1 - rect.y0 + 1);
+        }
+        std::swap(previous_, current_);
+        valid_ = true;
+    }
+
+    TGAImage& color();
+
+    DepthBuffer& depth();
+
+    // pixels the last render() cleared and redrew
+    long redrawn_pixels();
+
+private:
+    // what changed between previous_ and current_, merged into rectangles
+    void dirty_rects(std::vector<ScreenRect>& rects);
+
+    // mark the tiles under the triangles of an item
+    void mark(FrameGeometry::Item& item);
+
+    void clear(const ScreenRect& rect);
+
+    DepthBuffer depth_;
+    TGAImage color_;
+    FrameGeometry previous_;
+    FrameGeometry current_;
+    std::vector<unsigned char> dirty_;
+    int tilesx_;
+    int tilesy_;
+    bool valid_;
+    long redrawn_;
+};
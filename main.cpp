@@ -1,4 +1,23 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "depthexport.h"
+#include "framebuffer.h"
+#include "framestream.h"
+#include "imageencoder.h"
+#include "incremental.h"
+#include "meshstream.h"
 #include "model.h"
+#include "oit.h"
+#include "pipeline.h"
+#include "scene.h"
+#include "rasterizer.h"
+#include "shader.h"
+#include "texturecache.h"
 #include "tgaimage.h"
 
 const TGAColor white = TGAColor(255, 255, 255, 255);
@@ -6,17 +25,17 @@ const TGAColor red = TGAColor(255, 0, 0, 255);
 const TGAColor green = TGAColor(0, 255, 0, 255);
 const TGAColor blue = TGAColor(0, 0, 255, 255);
 
-Model* model = nullptr;
+Scene scene;
 
 const int width = 800;
 const int height = 600;
-const int depth = 255;
-
-int* zbuffer = nullptr;
+// depth range of the z-buffer, also sets the resolution shadow map comparisons work at
+const int depth = 2000;
 
 // define light direction
 Vec3f light_dir(-1, -1, -1);
-Vec3f camera(0, 0, 3);
+// looks from (0, 0, 3) at the origin unless set on the command line
+Camera camera;
 
 void DrawPixel(int x, int y, TGAImage& image, TGAColor color)
 {
@@ -25,41 +44,7 @@ void DrawPixel(int x, int y, TGAImage& image, TGAColor color)
 
 void DrawLine(Vec2i t0, Vec2i t1, TGAImage& image, TGAColor color)
 {
-    bool steep = false;
-    if (abs(t1.x - t0.x) < abs(t1.y - t0.y))
-    {
-        swap(t0.x, t0.y);
-        swap(t1.x, t1.y);
-        steep = true;
-    }
-
-    if (t0.x > t1.x)
-    {
-        swap(t0.x, t1.x);
-        swap(t0.y, t1.y);
-    }
-    int dx = t1.x - t0.x;
-    int dy = t1.y - t0.y;
-    int derror2 = abs(dy) * 2;
-    int error = 0;
-    int y = t0.y;
-    for (int x = t0.x; x <= t1.x; ++x)
-    {
-        if (steep)
-        {
-            DrawPixel(y, x, image, color);
-        }
-        else
-        {
-            DrawPixel(x, y, image, color);
-        }
-        error += derror2;
-        if (error > dx)
-        {
-            y += (t1.y > t0.y ? 1 : -1);
-            error -= dx * 2;
-        }
-    }
+    RasterizeLine<false>(Vec3i(t0.x, t0.y, 0), Vec3i(t1.x, t1.y, 0), color, image, nullptr);
 }
 
 Vec3f barycentric(Vec3i* pts, Vec3i p)
@@ -191,233 +176,665 @@ bool IsInTriangle(Vec2i* pts, Vec2i p)
     }
 }
 
-void DrawTriangle(Vec2i* pts, TGAImage& image, TGAColor color)
+void rasterize(Vec2i p0, Vec2i p1, TGAImage& tga_image, const TGAColor& color, int* ybuffer, int& ymax)
 {
-    Vec2i aabbboxmin(image.get_width() - 1, image.get_height() - 1);
-    Vec2i aabbboxmax(0, 0);
-
-    Vec2i clamp(image.get_width() - 1, image.get_height() - 1);
-    for (int i = 0; i < 3; ++i)
+    if (p0.x > p1.x)
     {
-        aabbboxmin.x = std::max(0, std::min(pts[i].x, aabbboxmin.x));
-        aabbboxmin.y = std::max(0, std::min(pts[i].y, aabbboxmin.y));
-        aabbboxmax.x = std::min(clamp.x, std::max(pts[i].x, aabbboxmax.x));
-        aabbboxmax.y = std::min(clamp.y, std::max(pts[i].y, aabbboxmax.y));
+        std::swap(p0, p1);
     }
 
-    Vec2i p;
-    for (p.x = aabbboxmin.x; p.x < aabbboxmax.x; ++p.x)
+    for (int x = p0.x; x < p1.x; ++x)
     {
-        for (p.y = aabbboxmin.y; p.y < aabbboxmax.y; ++p.y)
+        float t = (x - p0.x) / (float)(p1.x - p0.x);
+        int y = p0.y * (1. - t) + p1.y * t;
+        if (ybuffer[x] < y)
         {
-            if (IsInTriangle(pts, p))
+            ybuffer[x] = y;
+            for (int i = 0; i < 16; ++i)
             {
-                image.set(p.x, p.y, color);
+                tga_image.set(x, i, color);
             }
+            ymax = std::max(ymax, y);
         }
     }
 }
 
-void DrawTriangleWithZBuffer(Vec3i* pts, int* zbuffer, TGAImage& image, const TGAColor& color)
+ShadowMap* shadow = nullptr;
+// set in streaming mode, the mesh is then drawn a chunk at a time instead of through the scene
+MeshStream* stream = nullptr;
+
+/**
+ * \brief Command line settings applied to every rendered item
+ */
+struct RenderOptions
 {
-    Vec2i aabbboxmin(image.get_width() - 1, image.get_height() - 1);
-    Vec2i aabbboxmax(0, 0);
+    enum Wireframe
+    {
+        WIREFRAME_OFF,
+        // every edge, no faces
+        WIREFRAME_ALL,
+        // only the edges not hidden by faces
+        WIREFRAME_HIDDEN,
+        // visible edges over the shaded render
+        WIREFRAME_OVERLAY
+    };
 
-    Vec2i clamp(image.get_width() - 1, image.get_height() - 1);
-    for (int i = 0; i < 3; ++i)
+    RenderOptions(): shader_name("gouraud"), shadows(false), pcf(false), clusters(false), lods(0), pack(false),
+        streaming(false), frames(1), orbit_camera(true), orbit_light(false), orbit_instance(false),
+        incremental(false), wireframe(WIREFRAME_OFF), opacity(1.f), budget(MeshStream::DEFAULT_BUDGET), pickx(-1), picky(-1)
     {
-        aabbboxmin.x = std::max(0, std::min(pts[i].x, aabbboxmin.x));
-        aabbboxmin.y = std::max(0, std::min(pts[i].y, aabbboxmin.y));
-        aabbboxmax.x = std::min(clamp.x, std::max(pts[i].x, aabbboxmax.x));
-        aabbboxmax.y = std::min(clamp.y, std::max(pts[i].y, aabbboxmax.y));
     }
 
-    Vec3i p;
-    for (p.x = aabbboxmin.x; p.x < aabbboxmax.x; ++p.x)
+    std::string shader_name;
+    bool shadows;
+    bool pcf;
+    bool clusters;
+    int lods;
+    // keep the meshes in the compact attribute formats, see Model::pack
+    bool pack;
+    bool streaming;
+    int frames;
+    // what turns once around the y axis over the frames, orbit_instance spins the first instance in place
+    bool orbit_camera;
+    bool orbit_light;
+    bool orbit_instance;
+    // keep the buffers between frames and only redraw what changed
+    bool incremental;
+    Wireframe wireframe;
+    // of a single model, scene files give it per instance
+    float opacity;
+    size_t budget;
+    int pickx;
+    int picky;
+};
+
+/**
+ * \brief State of one frame in the render pipeline
+ */
+struct FrameJob
+{
+    int frame;
+    // world space to screen space
+    Matrix transform;
+    Vec3f light_dir;
+    FrameGeometry geometry;
+};
+
+// prepended to the output file names, set per item in batch mode
+std::string output_prefix;
+
+// how the depth buffer of every frame is written
+DepthExport depth_export(depth);
+// format of the color output
+ImageEncoder* encoder = ImageEncoder::for_format("tga");
+// set when frames go to stdout or a pipe instead of output files
+FrameStream* frame_stream = nullptr;
+// set for order-independent transparency, otherwise transparent instances blend in drawing order
+FragmentBuffer* fragments = nullptr;
+
+std::string FrameName(const char* base, int frame, int nframes, const char* ext = ".tga")
+{
+    if (nframes == 1)
     {
-        for (p.y = aabbboxmin.y; p.y < aabbboxmax.y; ++p.y)
-        {
-            auto bc_screen = barycentric(pts, p);
-            if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0)
-            {
-                continue;
-            }
+        return output_prefix + base + ext;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%04d%s", base, frame, ext);
+    return output_prefix + name;
+}
 
-            p.z = 0;
-            p.z += pts[0].z * bc_screen.x;
-            p.z += pts[1].z * bc_screen.y;
-            p.z += pts[2].z * bc_screen.z;
-            if (zbuffer[p.x + p.y * image.get_width()] > p.z)
-            {
-                continue;
-            }
+/**
+ * \brief Shadow map of a directional light, orthographic and scaled so the scene's bounding sphere fills the map
+ */
+void RenderShadowMap(Vec3f light, Vec3f center, float radius)
+{
+    shadow->transform = viewport(0, 0, width, height, depth) * scaling(1.f / radius) *
+        lookat(center - light, center, Vec3f(0, 1, 0));
+    shadow->depth.clear_lazy(false);
+    if (stream)
+    {
+        DrawStreamDepth(*stream, shadow->transform, shadow->depth);
+    }
+    else
+    {
+        DrawSceneDepth(scene, shadow->transform, shadow->depth);
+    }
+}
 
-            zbuffer[p.x + p.y * image.get_width()] = p.z;
-            image.set(p.x, p.y, color);
-        }
+/**
+ * \brief Camera and light of a frame, orbiting center once around the y axis over the batch
+ */
+void SetupFrame(const RenderOptions& options, int frame, const Matrix& projection, Vec3f center, FrameJob& job)
+{
+    const int nframes = options.frames;
+    job.frame = frame;
+    job.transform = projection;
+    job.light_dir = light_dir;
+    const float angle = 2.f * 3.14159265358979f * frame / nframes;
+    if (nframes > 1 && options.orbit_camera)
+    {
+        job.transform = projection * translation(center) * rotation(Vec3f(0, angle, 0)) * translation(center * -1);
+    }
+    if (nframes > 1 && options.orbit_light)
+    {
+        job.light_dir = m2v(rotation(Vec3f(0, angle, 0)) * v2m(light_dir));
+    }
+}
+
+void WriteFrame(int frame, int nframes, TGAImage& color, DepthBuffer& zbuffer)
+{
+    if (frame_stream)
+    {
+        frame_stream->write(color, *encoder);
+        return;
     }
+    color.write_file(FrameName("output", frame, nframes, encoder->extension()).c_str(), *encoder);
+    write_depth(zbuffer, depth_export, FrameName("depth", frame, nframes, depth_extension(depth_export.format)).c_str());
 }
 
-void DrawTriangleWithZBufferAndTexture(Vec3i* pts, Vec2f* uv, int* zbuffer_, TGAImage& image,
-                                       float* intensity)
+/**
+ * \brief Render the frames one after the other into the same buffers, redrawing only what changed.
+ * Frames where only the first instance moves redraw just the area it covers.
+ */
+template <class Shader>
+void RenderIncremental(const RenderOptions& options, const Matrix& projection, Vec3f center, float radius)
 {
-    Vec2i aabbboxmin(image.get_width() - 1, image.get_height() - 1);
-    Vec2i aabbboxmax(0, 0);
+    const int nframes = options.frames;
+    IncrementalRenderer renderer(width, height);
+    Instance& spun = scene.instance(0);
+    const Matrix rest = spun.transform;
+    Model* model = spun.model;
+    const Vec3f pivot = m2v(spun.transform * v2m((model->bbox_min() + model->bbox_max()) * .5f));
+    long redrawn = 0;
+    for (int frame = 0; frame < nframes; ++frame)
+    {
+        FrameJob job;
+        SetupFrame(options, frame, projection, center, job);
+        if (options.orbit_instance)
+        {
+            const float angle = 2.f * 3.14159265358979f * frame / nframes;
+            spun.transform = translation(pivot) * rotation(Vec3f(0, angle, 0)) * translation(pivot * -1) * rest;
+        }
+        // a moving light or occluder changes shadows anywhere on screen
+        if (shadow && frame > 0 && (options.orbit_light || options.orbit_instance))
+        {
+            RenderShadowMap(job.light_dir, center, radius);
+            renderer.invalidate();
+        }
+        renderer.render<Shader>(scene, job.transform, job.light_dir, shadow);
+        redrawn += renderer.redrawn_pixels();
+        WriteFrame(frame, nframes, renderer.color(), renderer.depth());
+    }
+    spun.transform = rest;
+    std::cout << "redrew " << redrawn * 100 / ((long)width * height * nframes) << "% of the pixels\n";
+}
 
-    Vec2i clamp(image.get_width() - 1, image.get_height() - 1);
-    for (int i = 0; i < 3; ++i)
+/**
+ * \brief Render the frames with the camera and/or the light orbiting center once around the y axis over the batch,
+ * overlapping geometry, rasterization and writing of consecutive frames
+ */
+template <class Shader>
+void Render(const RenderOptions& options, const Matrix& projection, Vec3f center, float radius)
+{
+    if (options.incremental && !stream && scene.ninstances() > 0)
     {
-        aabbboxmin.x = std::max(0, std::min(pts[i].x, aabbboxmin.x));
-        aabbboxmin.y = std::max(0, std::min(pts[i].y, aabbboxmin.y));
-        aabbboxmax.x = std::min(clamp.x, std::max(pts[i].x, aabbboxmax.x));
-        aabbboxmax.y = std::min(clamp.y, std::max(pts[i].y, aabbboxmax.y));
+        RenderIncremental<Shader>(options, projection, center, radius);
+        return;
     }
 
-    Vec3i p;
-    for (p.x = aabbboxmin.x; p.x < aabbboxmax.x; ++p.x)
+    const int nframes = options.frames;
+    FramePipeline<FrameJob> pipeline(width, height);
+    pipeline.run(nframes, [&](int frame, FrameJob& job)
+    {
+        SetupFrame(options, frame, projection, center, job);
+        if (!stream)
+        {
+            PrepareScene<Shader>(scene, job.transform, job.light_dir, width, height, job.geometry,
+                                 options.wireframe == RenderOptions::WIREFRAME_ALL);
+        }
+    }, [&](FrameJob& job, FrameBuffers& target)
     {
-        for (p.y = aabbboxmin.y; p.y < aabbboxmax.y; ++p.y)
+        // rasterization is sequential, so the shared shadow map can follow the light from frame to frame
+        if (shadow && nframes > 1 && options.orbit_light)
         {
-            auto bc_screen = barycentric(pts, p);
-            if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0)
+            RenderShadowMap(job.light_dir, center, radius);
+        }
+        target.depth.clear_lazy(true);
+        if (stream)
+        {
+            DrawStream<Shader>(*stream, job.transform, job.light_dir, target.depth, target.color, shadow);
+        }
+        else if (options.wireframe == RenderOptions::WIREFRAME_ALL ||
+            options.wireframe == RenderOptions::WIREFRAME_HIDDEN)
+        {
+            const bool hidden = options.wireframe == RenderOptions::WIREFRAME_HIDDEN;
+            if (hidden)
             {
-                continue;
+                DrawPreparedDepth(job.geometry, target.depth);
             }
-
-            p.z = 0;
-            p.z += pts[0].z * bc_screen.x;
-            p.z += pts[1].z * bc_screen.y;
-            p.z += pts[2].z * bc_screen.z;
-            if (zbuffer_[p.x + p.y * image.get_width()] > p.z)
+            target.depth.resolve(&target.color);
+            DrawPreparedWireframe(job.geometry, white, target.color, hidden ? &target.depth : nullptr);
+        }
+        else
+        {
+            if (fragments)
             {
-                continue;
+                fragments->clear();
             }
-
-            zbuffer_[p.x + p.y * image.get_width()] = p.z;
-            Vec2f uvp = uv[0] * bc_screen.x + uv[1] * bc_screen.y + uv[2] * bc_screen.z;
-            float intensityp = intensity[0] * bc_screen.x + intensity[1] * bc_screen.y +
-                intensity[2] * bc_screen.z;
-            if (intensityp < 0.2f)
+            DrawPrepared<Shader>(job.geometry, target.depth, target.color, shadow, nullptr, fragments);
+            if (fragments)
+            {
+                // fragments only land in tiles the rasterizer already initialized
+                fragments->resolve(target.color);
+                if (fragments->overflow() > 0)
+                {
+                    std::cerr << "frame " << job.frame << ": " << fragments->overflow()
+                        << " transparent fragments dropped, raise --oit-fragments\n";
+                }
+            }
+            if (options.wireframe == RenderOptions::WIREFRAME_OVERLAY)
             {
-                intensityp = 0.2f;
+                target.depth.resolve(&target.color);
+                DrawPreparedWireframe(job.geometry, green, target.color, &target.depth);
             }
-            TGAColor color_final = model->diffuse(uvp);
-            image.set(p.x, p.y, TGAColor(color_final.r * intensityp, color_final.g * intensityp,
-                                         color_final.b * intensityp, 255));
         }
-    }
+    }, [&](FrameJob& job, FrameBuffers& target)
+    {
+        // the tiles nothing was drawn to are only cleared now
+        target.depth.resolve(&target.color);
+        WriteFrame(job.frame, nframes, target.color, target.depth);
+    });
 }
 
-void rasterize(Vec2i p0, Vec2i p1, TGAImage& tga_image, const TGAColor& color, int* ybuffer, int& ymax)
+/**
+ * \brief Render one model, scene file or streamed mesh with the given options
+ * \return Process exit code
+ */
+int RenderItem(const std::string& model_path, RenderOptions options)
 {
-    if (p0.x > p1.x)
+    const std::string scene_ext = ".scene";
+    if (options.streaming)
     {
-        std::swap(p0, p1);
+        stream = new MeshStream(options.budget);
+        if (!stream->open(model_path.c_str()))
+        {
+            delete stream;
+            stream = nullptr;
+            return 1;
+        }
     }
-
-    for (int x = p0.x; x < p1.x; ++x)
+    else if (model_path.size() > scene_ext.size() &&
+        model_path.compare(model_path.size() - scene_ext.size(), scene_ext.size(), scene_ext) == 0)
     {
-        float t = (x - p0.x) / (float)(p1.x - p0.x);
-        int y = p0.y * (1. - t) + p1.y * t;
-        if (ybuffer[x] < y)
+        if (!scene.load(model_path.c_str()))
         {
-            ybuffer[x] = y;
-            for (int i = 0; i < 16; ++i)
+            scene.clear();
+            return 1;
+        }
+    }
+    else
+    {
+        Model* model = scene.add_model(model_path);
+        if (!model)
+        {
+            std::cerr << "skipping " << model_path << "\n";
+            return 1;
+        }
+        scene.add_instance(model, Matrix::identity(4), options.opacity);
+    }
+    for (int i = 0; i < scene.nmodels(); ++i)
+    {
+        Model* model = scene.model(i);
+        if (options.lods > 0)
+        {
+            model->build_lods(options.lods);
+            for (int level = 1; level < model->nlods(); ++level)
             {
-                tga_image.set(x, i, color);
+                std::cout << "lod " << level << ": " << model->lod(level)->nfaces() << " faces" << std::endl;
             }
-            ymax = std::max(ymax, y);
+        }
+        for (int level = 0; options.clusters && level < model->nlods(); ++level)
+        {
+            Model* lod = model->lod(level);
+            lod->build_clusters();
+            std::cout << lod->nfaces() << " faces in " << lod->clusters()->nclusters() << " clusters"
+                << (lod->clusters()->closed() ? ", closed" : "") << std::endl;
+        }
+        if (options.pack)
+        {
+            model->pack();
         }
     }
-}
-
-Matrix viewport(int x, int y, int w, int h)
-{
-    Matrix m = Matrix::identity(4);
-    m[0][3] = x + w / 2.f;
-    m[1][3] = y + h / 2.f;
-    m[2][3] = depth / 2.f;
-
-    m[0][0] = w / 2.f;
-    m[1][1] = h / 2.f;
-    m[2][2] = depth / 2.f;
-    return m;
-}
 
-Vec3f m2v(Matrix m)
-{
-    return Vec3f(m[0][0] / m[3][0], m[1][0] / m[3][0], m[2][0] / m[3][0]);
-}
+    Matrix transform = camera.transform();
 
-Matrix v2m(Vec3f v)
-{
-    Matrix m(4, 1);
-    m[0][0] = v.x;
-    m[1][0] = v.y;
-    m[2][0] = v.z;
-    m[3][0] = 1.f;
-    return m;
-}
+    if (options.pickx >= 0)
+    {
+        PickResult picked;
+        if (scene.pick(transform, options.pickx, options.picky, picked))
+        {
+            std::cout << "instance " << picked.instance << " face " << picked.face << " uv " << picked.uv.u << " "
+                << picked.uv.v << "\n";
+        }
+        else
+        {
+            std::cout << "nothing at " << options.pickx << " " << options.picky << "\n";
+        }
+    }
 
-int main(int argc, char* argv[])
-{
-    if (argc == 2)
+    Vec3f lo, hi;
+    if (stream)
     {
-        model = new Model(argv[1]);
+        lo = stream->bbox_min();
+        hi = stream->bbox_max();
     }
     else
     {
-        model = new Model("obj/african_head.obj");
+        scene.bounds(lo, hi);
+    }
+    Vec3f center = (lo + hi) * .5f;
+
+    float radius = std::max((hi - lo).norm() * .5f, 1e-6f);
+
+    if (options.shadows)
+    {
+        shadow = new ShadowMap(width, height);
+        shadow->pcf = options.pcf;
+        RenderShadowMap(light_dir, center, radius);
+    }
+
+    bool object_normals = !stream || stream->chunk().has_normalmap();
+    bool tangent_normals = !stream || stream->chunk().has_tangent_normalmap();
+    for (int i = 0; i < scene.nmodels(); ++i)
+    {
+        object_normals = object_normals && scene.model(i)->has_normalmap();
+        tangent_normals = tangent_normals && scene.model(i)->has_tangent_normalmap();
+    }
+    if (options.shader_name == "normalmap" && !object_normals && !tangent_normals)
+    {
+        std::cerr << "no normal map, falling back to phong\n";
+        options.shader_name = "phong";
     }
 
-    zbuffer = new int [width * height];
-    for (int i = 0; i < width * height; ++i)
+    if (options.shader_name == "phong")
     {
-        zbuffer[i] = std::numeric_limits<int>::min();
+        Render<PhongShader>(options, transform, center, radius);
+    }
+    else if (options.shader_name == "normalmap" && tangent_normals)
+    {
+        Render<TangentNormalShader>(options, transform, center, radius);
+    }
+    else if (options.shader_name == "normalmap")
+    {
+        Render<NormalMappedShader>(options, transform, center, radius);
+    }
+    else if (options.shader_name == "unlit")
+    {
+        Render<UnlitShader>(options, transform, center, radius);
+    }
+    else
+    {
+        Render<GouraudShader>(options, transform, center, radius);
     }
 
-    TGAImage output(width, height, TGAImage::RGB);
-    for (int i = 0; i < model->nfaces(); ++i)
+    if (stream)
     {
-        std::vector<Vec3i> face = model->face(i);
-        Vec3i screen_coords[3];
-        Vec3f world_coords[3];
-        Vec2f uv[3];
-        float intensity[3];
+        std::cout << "streamed " << stream->nfaces() << " faces in chunks of " << stream->chunk_faces() << ", peak "
+            << (stream->peak_bytes() >> 10) << " KB of a " << (stream->budget_bytes() >> 10) << " KB budget\n";
+    }
 
-        Matrix Projection = Matrix::identity(4);
-        Projection[3][2] = -1.f / camera.z;
-        Matrix ViewPort = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+    delete shadow;
+    delete stream;
+    shadow = nullptr;
+    stream = nullptr;
+    scene.clear();
+    return 0;
+}
 
-        for (int j = 0; j < 3; ++j)
+int main(int argc, char* argv[])
+{
+    // SoftRenderer [model.obj|room.scene] [gouraud|phong|normalmap|unlit] [--shadows] [--pcf]
+    //             [--clusters] [--optimize] [--lods n] [--pack] [--pick x y]
+    //             [--stream] [--budget megabytes] [--frames n] [--batch list.txt]
+    //             [--format tga|png|ppm|pfm] [--depth-format gray|raw16|raw32|pfm] [--depth-linear]
+    //             [--depth-normalize] [--orbit camera|light|both|instance] [--incremental] [--pipe] [--fd n]
+    //             [--wireframe all|hidden|overlay] [--opacity a] [--oit] [--oit-fragments per pixel]
+    //             [--eye x y z] [--center x y z] [--fov degrees] [--ortho half height]
+    std::string model_path = "obj/african_head.obj";
+    std::string batch_path;
+    RenderOptions options;
+    int pipe_fd = -1;
+    int oit_fragments = -1;
+    bool depth_linear = false;
+    Vec3f eye = camera.eye();
+    Vec3f center = camera.center();
+    bool format_given = false;
+    int positional = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--shadows")
         {
-            Vec3f vertice = model->vert(face[j].ivert);
-            screen_coords[j] = m2v(ViewPort * Projection * v2m(vertice));
-            world_coords[j] = vertice;
-            uv[j] = model->uv(face[j].iuv);
-            intensity[j] = model->norm(face[j].inorm) * (light_dir * -1);
+            options.shadows = true;
         }
+        else if (arg == "--pcf")
+        {
+            options.shadows = options.pcf = true;
+        }
+        else if (arg == "--optimize")
+        {
+            scene.set_optimize_meshes(true);
+        }
+        else if (arg == "--clusters")
+        {
+            options.clusters = true;
+        }
+        else if (arg == "--lods" && i + 1 < argc)
+        {
+            options.lods = atoi(argv[++i]);
+        }
+        else if (arg == "--pack")
+        {
+            options.pack = true;
+        }
+        else if (arg == "--stream")
+        {
+            options.streaming = true;
+        }
+        else if (arg == "--budget" && i + 1 < argc)
+        {
+            options.streaming = true;
+            options.budget = (size_t)atoi(argv[++i]) << 20;
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+        {
+            options.frames = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--depth-format" && i + 1 < argc)
+        {
+            std::string format = argv[++i];
+            depth_export.format = format == "raw16" ? DepthExport::RAW16 :
+                format == "raw32" ? DepthExport::RAW32 :
+                format == "pfm" ? DepthExport::PFM : DepthExport::GRAY8;
+        }
+        else if (arg == "--orbit" && i + 1 < argc)
+        {
+            std::string orbit = argv[++i];
+            options.orbit_camera = orbit == "camera" || orbit == "both";
+            options.orbit_light = orbit == "light" || orbit == "both";
+            options.orbit_instance = orbit == "instance";
+        }
+        else if (arg == "--wireframe" && i + 1 < argc)
+        {
+            std::string mode = argv[++i];
+            options.wireframe = mode == "all" ? RenderOptions::WIREFRAME_ALL :
+                mode == "hidden" ? RenderOptions::WIREFRAME_HIDDEN : RenderOptions::WIREFRAME_OVERLAY;
+        }
+        else if (arg == "--eye" && i + 3 < argc)
+        {
+            eye = Vec3f((float)atof(argv[i + 1]), (float)atof(argv[i + 2]), (float)atof(argv[i + 3]));
+            i += 3;
+        }
+        else if (arg == "--center" && i + 3 < argc)
+        {
+            center = Vec3f((float)atof(argv[i + 1]), (float)atof(argv[i + 2]), (float)atof(argv[i + 3]));
+            i += 3;
+        }
+        else if (arg == "--fov" && i + 1 < argc)
+        {
+            camera.perspective((float)atof(argv[++i]));
+        }
+        else if (arg == "--ortho" && i + 1 < argc)
+        {
+            camera.orthographic((float)atof(argv[++i]));
+        }
+        else if (arg == "--opacity" && i + 1 < argc)
+        {
+            options.opacity = (float)atof(argv[++i]);
+        }
+        else if (arg == "--oit")
+        {
+            oit_fragments = std::max(oit_fragments, 0);
+        }
+        else if (arg == "--oit-fragments" && i + 1 < argc)
+        {
+            oit_fragments = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--incremental")
+        {
+            options.incremental = true;
+        }
+        else if (arg == "--pipe")
+        {
+            pipe_fd = 1;
+        }
+        else if (arg == "--fd" && i + 1 < argc)
+        {
+            pipe_fd = atoi(argv[++i]);
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            format_given = true;
+            ImageEncoder* format = ImageEncoder::for_format(argv[++i]);
+            if (!format)
+            {
+                std::cerr << "unknown format " << argv[i] << ", writing tga\n";
+            }
+            encoder = format ? format : encoder;
+        }
+        else if (arg == "--depth-linear")
+        {
+            depth_linear = true;
+        }
+        else if (arg == "--depth-normalize")
+        {
+            depth_export.normalize = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batch_path = argv[++i];
+        }
+        else if (arg == "--pick" && i + 2 < argc)
+        {
+            options.pickx = atoi(argv[++i]);
+            options.picky = atoi(argv[++i]);
+        }
+        else if (positional++ == 0)
+        {
+            model_path = arg;
+        }
+        else
+        {
+            options.shader_name = arg;
+        }
+    }
 
-        // DrawTriangle(screen_coords, output, TGAColor(intensity * 255, intensity * 255, intensity * 255, 255));
-        DrawTriangleWithZBufferAndTexture(screen_coords, uv, zbuffer, output, intensity);
+    // the incremental renderer only draws shaded instances, blended in drawing order
+    if (options.incremental && (options.wireframe != RenderOptions::WIREFRAME_OFF || oit_fragments >= 0 ||
+        options.streaming))
+    {
+        std::cerr << "--incremental can't be combined with --wireframe, --oit or --stream\n";
+        return 1;
+    }
+    // moving an instance while the pipeline's geometry stage reads the scene isn't safe
+    if (options.orbit_instance && !options.incremental)
+    {
+        std::cerr << "--orbit instance needs --incremental\n";
+        return 1;
     }
 
-    output.write_tga_file("output.tga");
+    if (pipe_fd >= 0)
+    {
+        // raw frames unless asked otherwise, nothing is written to disk
+        encoder = format_given ? encoder : ImageEncoder::for_format("rgb24");
+        frame_stream = new FrameStream(pipe_fd);
+        if (pipe_fd == 1)
+        {
+            // keep the log out of the frame data
+            std::cout.rdbuf(std::cerr.rdbuf());
+        }
+    }
 
-    TGAImage depth_image(width, height, TGAImage::RGB);
+    camera.look_at(eye, center);
+    camera.set_viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4, depth);
+    if (depth_linear)
+    {
+        // orthographic depth is linear already
+        depth_export.camera = camera.distance();
+    }
 
-    for (int y = 0; y < height; ++y)
+    if (oit_fragments >= 0)
     {
-        for (int x = 0; x < width; ++x)
+        // one arena for all frames, the raster stage runs them one after the other
+        fragments = new FragmentBuffer(width, height, (size_t)width * height *
+            (oit_fragments ? oit_fragments : FragmentBuffer::DEFAULT_FRAGMENTS_PER_PIXEL));
+    }
+
+    std::vector<std::string> items;
+    if (batch_path.empty())
+    {
+        items.push_back(model_path);
+    }
+    else
+    {
+        // the list replaces the model argument, so a single positional one is the shader
+        if (positional == 1)
         {
-            depth_image.set(x, y, TGAColor(max(zbuffer[x + y * width] * 255 / depth, 0),
-                                           max(zbuffer[x + y * width] * 255 / depth, 0),
-                                           max(zbuffer[x + y * width] * 255 / depth, 0), 255));
+            options.shader_name = model_path;
+        }
+        // one model, scene file or mesh per line, each rendered to item_NNN_output.tga and so on
+        std::ifstream list(batch_path.c_str());
+        std::string line;
+        while (std::getline(list, line))
+        {
+            if (!line.empty() && line[0] != '#')
+            {
+                items.push_back(line);
+            }
         }
     }
 
-    depth_image.write_tga_file("depth.tga");
-
-    delete model;
-    return 0;
+    int status = 0;
+    for (size_t k = 0; k < items.size(); ++k)
+    {
+        // the next item's files load on the I/O threads while this one renders
+        if (k + 1 < items.size() && !options.streaming)
+        {
+            Scene::prefetch(items[k + 1], scene.optimize_meshes());
+        }
+        if (!batch_path.empty())
+        {
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "item_%03d_", (int)k);
+            output_prefix = prefix;
+            std::cout << items[k] << "\n";
+        }
+        status = std::max(status, RenderItem(items[k], options));
+        // RenderItem cleared the scene, drop the textures only its models used; the next item's prefetch holds
+        // its own, also while its models are still loading
+        TextureCache::instance().evict_unused();
+    }
+    delete fragments;
+    delete frame_stream;
+    return status;
 }
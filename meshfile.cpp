@@ -0,0 +1,57 @@
+﻿#include "meshfile.h"
+
+#include <cstring>
+#include <sys/stat.h>
+
+std::string mesh_file_path(const char* filename, const char* suffix)
+{
+    return std::string(filename) + suffix;
+}
+
+bool mesh_file_stamp(const char* filename, long long& size, long long& mtime)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        return false;
+    }
+    size = (long long)st.st_size;
+    mtime = (long long)st.st_mtime;
+    return true;
+}
+
+bool read_mesh_header(std::istream& in, const char* source, MeshFileHeader& header)
+{
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MESH_FILE_VERSION || header.nverts < 0 || header.nuv < 0 || header.nnorm < 0 ||
+        header.nfaces < 0)
+    {
+        return false;
+    }
+    if (source)
+    {
+        long long size;
+        long long mtime;
+        if (!mesh_file_stamp(source, size, mtime) || header.source_size != size || header.source_mtime != mtime)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+long long mesh_file_uv_offset(const MeshFileHeader& header)
+{
+    return (long long)sizeof(MeshFileHeader) + (long long)header.nverts * sizeof(Vec3f);
+}
+
+long long mesh_file_norm_offset(const MeshFileHeader& header)
+{
+    return mesh_file_uv_offset(header) + (long long)header.nuv * sizeof(Vec2f);
+}
+
+long long mesh_file_face_offset(const MeshFileHeader& header)
+{
+    return mesh_file_norm_offset(header) + (long long)header.nnorm * sizeof(Vec3f);
+}
@@ -0,0 +1,59 @@
+﻿#pragma once
+#include <istream>
+#include <string>
+#include "geometry.h"
+
+/**
+ * \brief Binary mesh file, written next to the obj as <obj>.mesh, or <obj>.stream.mesh for MeshStream:
+ *   MeshFileHeader, verts (Vec3f), uvs (Vec2f), normals (Vec3f), then 3 x Vec3i (vert, uv, normal indices)
+ *   per triangle.
+ * Native endianness, it's a local cache and not an interchange format. Shared by Model's optimized mesh cache
+ * and MeshStream, which reads it a chunk at a time; each keeps its own file since only Model's is reordered.
+ */
+const char MESH_FILE_MAGIC[8] = {'S', 'R', 'M', 'E', 'S', 'H', '\0', '\0'};
+const int MESH_FILE_VERSION = 2;
+
+// faces and vertices were reordered by Model's vertex cache optimization
+const int MESH_FILE_OPTIMIZED = 1;
+
+struct MeshFileHeader
+{
+    char magic[8];
+    int version;
+    int flags;
+    int nverts;
+    int nuv;
+    int nnorm;
+    int nfaces;
+    // the obj the file was built from, the file is stale when either changed
+    long long source_size;
+    long long source_mtime;
+    // object space bounds of the vertices
+    float bbox_min[3];
+    float bbox_max[3];
+};
+
+static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f is written as raw floats");
+static_assert(sizeof(Vec2f) == 2 * sizeof(float), "Vec2f is written as raw floats");
+static_assert(sizeof(Vec3i) == 3 * sizeof(int), "Vec3i is written as raw ints");
+
+const char MESH_FILE_SUFFIX[] = ".mesh";
+const char STREAM_FILE_SUFFIX[] = ".stream.mesh";
+
+std::string mesh_file_path(const char* filename, const char* suffix = MESH_FILE_SUFFIX);
+
+/**
+ * \brief Size and modification time of the source file
+ */
+bool mesh_file_stamp(const char* filename, long long& size, long long& mtime);
+
+/**
+ * \brief Read and check the header of a mesh file
+ * \param source The obj it must have been built from, or null to accept any
+ */
+bool read_mesh_header(std::istream& in, const char* source, MeshFileHeader& header);
+
+// byte offsets of the sections
+long long mesh_file_uv_offset(const MeshFileHeader& header);
+long long mesh_file_norm_offset(const MeshFileHeader& header);
+long long mesh_file_face_offset(const MeshFileHeader& header);
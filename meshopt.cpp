@@ -0,0 +1,155 @@
+﻿#include "meshopt.h"
+
+float vertex_cache_acmr(const std::vector<int>& indices, int nverts, int cache_size)
+{
+    if (indices.size() < 3)
+    {
+        return 0.f;
+    }
+
+    // a vertex is in the FIFO while fewer than cache_size misses happened since it was loaded
+    std::vector<int> loaded(nverts, -cache_size - 1);
+    int misses = 0;
+    for (int v : indices)
+    {
+        if (misses - loaded[v] > cache_size)
+        {
+            loaded[v] = misses++;
+        }
+    }
+    return (float)misses / (indices.size() / 3);
+}
+
+std::vector<int> optimize_vertex_cache(const std::vector<int>& indices, int nverts, int cache_size)
+{
+    const int ntris = (int)indices.size() / 3;
+
+    // vertex to triangle adjacency, compressed rows
+    std::vector<int> live(nverts, 0);
+    for (int v : indices)
+    {
+        live[v]++;
+    }
+    std::vector<int> offset(nverts + 1, 0);
+    for (int v = 0; v < nverts; ++v)
+    {
+        offset[v + 1] = offset[v] + live[v];
+    }
+    std::vector<int> adjacency(indices.size());
+    std::vector<int> fill(offset.begin(), offset.end() - 1);
+    for (int t = 0; t < ntris; ++t)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            adjacency[fill[indices[t * 3 + j]]++] = t;
+        }
+    }
+
+    std::vector<int> order;
+    order.reserve(ntris);
+    std::vector<int> timestamp(nverts, 0);
+    std::vector<char> emitted(ntris, 0);
+    std::vector<int> deadend;
+    std::vector<int> candidates;
+    int time = cache_size + 1;
+    int cursor = 0;
+
+    int fan = 0;
+    while (fan < nverts && live[fan] == 0)
+    {
+        ++fan;
+    }
+    while (fan < nverts)
+    {
+        candidates.clear();
+        for (int k = offset[fan]; k < offset[fan + 1]; ++k)
+        {
+            const int t = adjacency[k];
+            if (emitted[t])
+            {
+                continue;
+            }
+            emitted[t] = 1;
+            order.push_back(t);
+            for (int j = 0; j < 3; ++j)
+            {
+                const int v = indices[t * 3 + j];
+                deadend.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - timestamp[v] > cache_size)
+                {
+                    timestamp[v] = time++;
+                }
+            }
+        }
+
+        // best candidate: still has triangles and stays cached while they are emitted, oldest in the cache first
+        // so it is used up before it's evicted
+        int next = -1;
+        int best = -1;
+        for (int v : candidates)
+        {
+            if (live[v] == 0)
+            {
+                continue;
+            }
+            int priority = 0;
+            if (time - timestamp[v] + 2 * live[v] <= cache_size)
+            {
+                priority = time - timestamp[v];
+            }
+            if (priority > best)
+            {
+                best = priority;
+                next = v;
+            }
+        }
+
+        // dead end: back track through recently used vertices, then scan forward in input order
+        while (next < 0 && !deadend.empty())
+        {
+            const int v = deadend.back();
+            deadend.pop_back();
+            if (live[v] > 0)
+            {
+                next = v;
+            }
+        }
+        while (next < 0 && cursor < nverts)
+        {
+            if (live[cursor] > 0)
+            {
+                next = cursor;
+            }
+            ++cursor;
+        }
+        fan = next < 0 ? nverts : next;
+    }
+    return order;
+}
+
+std::vector<int> optimize_vertex_fetch(std::vector<int>& indices, int nverts)
+{
+    std::vector<int> remap(nverts, -1);
+    std::vector<int> order;
+    order.reserve(nverts);
+    for (int& v : indices)
+    {
+        if (remap[v] < 0)
+        {
+            remap[v] = (int)order.size();
+            order.push_back(v);
+        }
+        v = remap[v];
+    }
+    for (int v = 0; v < nverts; ++v)
+    {
+        if (remap[v] < 0)
+        {
+            remap[v] = (int)order.size();
+            order.push_back(v);
+        }
+    }
+    return order;
+}
@@ -0,0 +1,31 @@
+﻿#pragma once
+#include <vector>
+
+/**
+ * \brief Cache size the reordering targets, a typical post-transform cache holds 16 to 32 vertices
+ */
+const int VERTEX_CACHE_SIZE = 16;
+
+/**
+ * \brief Average cache miss ratio: transformed vertices per triangle with a FIFO cache of cache_size entries.
+ * 3 is the worst case, ~0.5 to 0.7 is what a good ordering of a regular mesh reaches.
+ * \param indices Vertex indices, three per triangle
+ */
+float vertex_cache_acmr(const std::vector<int>& indices, int nverts, int cache_size = VERTEX_CACHE_SIZE);
+
+/**
+ * \brief Tipsify triangle reordering (Sander, Nehab and Barczak 2007).
+ * Triangles are emitted in fans around a current vertex; the next fan is the most recently used vertex that
+ * will still be in the cache after its remaining triangles, so reuse stays local without a full cache simulation.
+ * \param indices Vertex indices, three per triangle
+ * \return For each output triangle, the index of the input triangle
+ */
+std::vector<int> optimize_vertex_cache(const std::vector<int>& indices, int nverts, int cache_size = VERTEX_CACHE_SIZE);
+
+/**
+ * \brief Renumber vertices in order of first use, so vertex fetches walk the arrays front to back.
+ * Unused vertices keep their relative order at the end.
+ * \param indices Vertex indices, remapped in place
+ * \return For each new vertex index, the old one
+ */
+std::vector<int> optimize_vertex_fetch(std::vector<int>& indices, int nverts);
@@ -0,0 +1,341 @@
+﻿#include "meshstream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+    // reads from the mesh file go through a window this large, nearby vertices are fetched in one read
+    const size_t STREAM_READ_WINDOW = 64 << 10;
+
+    // worst case bytes a chunk holds per face: the corners as read, the sorted index lists, the face vector
+    // in the Model (with an estimated 16 bytes of heap overhead), three new vertices with all attributes, and
+    // what TransformVertices keeps for them: screen position, intensity, culled face, index lists and marks
+    const size_t STREAM_BYTES_PER_FACE = 3 * sizeof(Vec3i) + 3 * 3 * sizeof(int) +
+        sizeof(std::vector<Vec3i>) + 3 * sizeof(Vec3i) + 16 + 3 * (sizeof(Vec3f) + sizeof(Vec2f) + sizeof(Vec3f)) +
+        sizeof(int) + 3 * (sizeof(Vec3i) + sizeof(float) + 2 * sizeof(int) + 1);
+
+    bool ends_with(const std::string& s, const std::string& suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    bool append_file(std::ofstream& out, const std::string& path, std::vector<char>& buffer)
+    {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        while (in)
+        {
+            in.read(buffer.data(), buffer.size());
+            out.write(buffer.data(), in.gcount());
+        }
+        in.close();
+        std::remove(path.c_str());
+        return (bool)out;
+    }
+}
+
+MeshStream::MeshStream(size_t budget_bytes)
+    : budget_(budget_bytes),
+      peak_(0),
+      chunk_faces_(1),
+      cursor_(0),
+      header_(),
+      chunk_(new Model())
+{
+    window_.resize(STREAM_READ_WINDOW);
+    if (budget_ > STREAM_READ_WINDOW)
+    {
+        chunk_faces_ = (int)std::max<size_t>(1, (budget_ - STREAM_READ_WINDOW) / STREAM_BYTES_PER_FACE);
+    }
+}
+
+MeshStream::~MeshStream()
+{
+}
+
+bool MeshStream::convert(const char* obj, const std::string& mesh)
+{
+    std::ifstream in(obj);
+    if (in.fail())
+    {
+        return false;
+    }
+
+    // the sections go to temporary files first since the header needs the counts
+    const std::string sections[4] = {mesh + ".v", mesh + ".vt", mesh + ".vn", mesh + ".f"};
+    std::ofstream out[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        out[i].open(sections[i].c_str(), std::ios::binary);
+    }
+
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    Vec3f lo(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+             std::numeric_limits<float>::max());
+    Vec3f hi = lo * -1.f;
+
+    // same subset of obj as Model::read_obj, polygons are split into fans
+    std::string line;
+    std::vector<Vec3i> polygon;
+    while (std::getline(in, line))
+    {
+        std::istringstream iss(line.c_str());
+        char trash;
+        if (!line.compare(0, 2, "v "))
+        {
+            Vec3f v;
+            iss >> trash >> v.x >> v.y >> v.z;
+            out[0].write(reinterpret_cast<const char*>(&v), sizeof(v));
+            lo = Vec3f(std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z));
+            hi = Vec3f(std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z));
+            header.nverts++;
+        }
+        else if (!line.compare(0, 2, "vt"))
+        {
+            Vec2f uv;
+            iss >> trash >> trash >> uv.x >> uv.y;
+            out[1].write(reinterpret_cast<const char*>(&uv), sizeof(uv));
+            header.nuv++;
+        }
+        else if (!line.compare(0, 2, "vn"))
+        {
+            Vec3f n;
+            iss >> trash >> trash >> n.x >> n.y >> n.z;
+            out[2].write(reinterpret_cast<const char*>(&n), sizeof(n));
+            header.nnorm++;
+        }
+        else if (!line.compare(0, 2, "f "))
+        {
+            polygon.clear();
+            Vec3i temp;
+            iss >> trash;
+            while (iss >> temp.raw[0] >> trash >> temp.raw[1] >> trash >> temp.raw[2])
+            {
+                // in wavefront obj all indices start at 1, not zero
+                polygon.push_back(temp - Vec3i(1, 1, 1));
+            }
+            for (size_t i = 2; i < polygon.size(); ++i)
+            {
+                Vec3i face[3] = {polygon[0], polygon[i - 1], polygon[i]};
+                out[3].write(reinterpret_cast<const char*>(face), sizeof(face));
+                header.nfaces++;
+            }
+        }
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        header.bbox_min[i] = header.nverts ? lo.raw[i] : 0.f;
+        header.bbox_max[i] = header.nverts ? hi.raw[i] : 0.f;
+    }
+    mesh_file_stamp(obj, header.source_size, header.source_mtime);
+
+    bool ok = true;
+    for (int i = 0; i < 4; ++i)
+    {
+        ok = ok && (bool)out[i];
+        out[i].close();
+    }
+    std::ofstream file(mesh.c_str(), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::vector<char> buffer(STREAM_READ_WINDOW);
+    for (int i = 0; i < 4; ++i)
+    {
+        ok = append_file(file, sections[i], buffer) && ok;
+    }
+    if (!ok)
+    {
+        file.close();
+        std::remove(mesh.c_str());
+        std::cerr << "can't write mesh file " << mesh << std::endl;
+    }
+    return ok;
+}
+
+bool MeshStream::open(const char* filename)
+{
+    std::string path = filename;
+    std::string obj = filename;
+    const char* source = filename;
+    if (ends_with(path, MESH_FILE_SUFFIX))
+    {
+        const std::string suffix = ends_with(path, STREAM_FILE_SUFFIX) ? STREAM_FILE_SUFFIX : MESH_FILE_SUFFIX;
+        obj = path.substr(0, path.size() - suffix.size());
+        source = nullptr;
+    }
+    else
+    {
+        path = mesh_file_path(filename, STREAM_FILE_SUFFIX);
+    }
+
+    in_.close();
+    in_.clear();
+    in_.open(path.c_str(), std::ios::binary);
+    if (in_.fail() || !read_mesh_header(in_, source, header_))
+    {
+        if (!source || !convert(source, path))
+        {
+            std::cerr << "can't open mesh " << filename << std::endl;
+            return false;
+        }
+        in_.close();
+        in_.clear();
+        in_.open(path.c_str(), std::ios::binary);
+        if (in_.fail() || !read_mesh_header(in_, source, header_))
+        {
+            return false;
+        }
+    }
+
+    chunk_->diffusemap_ = chunk_->load_texture(obj, 0);
+    chunk_->normalmap_ = chunk_->load_texture(obj, 1);
+    chunk_->tangentnormalmap_ = chunk_->load_texture(obj, 2);
+    chunk_->specularmap_ = chunk_->load_texture(obj, 3);
+    std::cerr << "# stream v# " << header_.nverts << " f# " << header_.nfaces << " in chunks of " << chunk_faces_
+        << std::endl;
+    rewind();
+    return true;
+}
+
+Model* MeshStream::next()
+{
+    if (cursor_ >= header_.nfaces)
+    {
+        return nullptr;
+    }
+    const int n = std::min(chunk_faces_, header_.nfaces - cursor_);
+    corners_.resize(n * 3);
+    in_.clear();
+    in_.seekg(mesh_file_face_offset(header_) + (long long)cursor_ * 3 * sizeof(Vec3i));
+    in_.read(reinterpret_cast<char*>(corners_.data()), corners_.size() * sizeof(Vec3i));
+    cursor_ += n;
+
+    // only the vertices this chunk uses, in file order
+    for (int s = 0; s < 3; ++s)
+    {
+        std::vector<int>& indices = indices_[s];
+        indices.resize(corners_.size());
+        for (size_t i = 0; i < corners_.size(); ++i)
+        {
+            indices[i] = corners_[i].raw[s];
+        }
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    }
+    Model& chunk = *chunk_;
+    chunk.verts_.resize(indices_[0].size());
+    chunk.uv_.resize(indices_[1].size());
+    chunk.norm_.resize(indices_[2].size());
+    read_rows(sizeof(MeshFileHeader), sizeof(Vec3f), indices_[0], reinterpret_cast<char*>(chunk.verts_.data()));
+    read_rows(mesh_file_uv_offset(header_), sizeof(Vec2f), indices_[1], reinterpret_cast<char*>(chunk.uv_.data()));
+    read_rows(mesh_file_norm_offset(header_), sizeof(Vec3f), indices_[2],
+              reinterpret_cast<char*>(chunk.norm_.data()));
+
+    chunk.faces_.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        chunk.faces_[i].resize(3);
+        for (int j = 0; j < 3; ++j)
+        {
+            Vec3i& corner = chunk.faces_[i][j];
+            for (int s = 0; s < 3; ++s)
+            {
+                const std::vector<int>& indices = indices_[s];
+                corner.raw[s] = (int)(std::lower_bound(indices.begin(), indices.end(), corners_[i * 3 + j].raw[s]) -
+                    indices.begin());
+            }
+        }
+    }
+    chunk.compute_bounds();
+
+    size_t bytes = corners_.capacity() * sizeof(Vec3i) + window_.capacity() +
+        chunk.verts_.capacity() * sizeof(Vec3f) + chunk.uv_.capacity() * sizeof(Vec2f) +
+        chunk.norm_.capacity() * sizeof(Vec3f) + chunk.faces_.capacity() * sizeof(std::vector<Vec3i>) +
+        chunk.faces_.size() * (3 * sizeof(Vec3i) + 16);
+    for (int s = 0; s < 3; ++s)
+    {
+        bytes += indices_[s].capacity() * sizeof(int);
+    }
+    // drawing the chunk culls it into a per-thread face list, and large chunks fill TransformVertices' arrays
+    bytes += chunk.nfaces() * sizeof(int);
+    if (ParallelVertices(chunk))
+    {
+        bytes += chunk.nverts() * (sizeof(Vec3i) + sizeof(int) + 1) + chunk.nnorms() * (sizeof(float) + sizeof(int));
+    }
+    peak_ = std::max(peak_, bytes);
+    return chunk_.get();
+}
+
+void MeshStream::read_rows(long long offset, size_t size, const std::vector<int>& indices, char* out)
+{
+    const int window_rows = (int)std::max<size_t>(1, window_.size() / size);
+    size_t i = 0;
+    while (i < indices.size())
+    {
+        const int first = indices[i];
+        size_t j = i + 1;
+        while (j < indices.size() && indices[j] - first < window_rows)
+        {
+            ++j;
+        }
+        const int count = indices[j - 1] - first + 1;
+        in_.clear();
+        in_.seekg(offset + (long long)first * size);
+        in_.read(window_.data(), (std::streamsize)count * size);
+        if (!in_)
+        {
+            std::cerr << "mesh file truncated" << std::endl;
+            return;
+        }
+        for (size_t k = i; k < j; ++k)
+        {
+            memcpy(out + k * size, window_.data() + (size_t)(indices[k] - first) * size, size);
+        }
+        i = j;
+    }
+}
+
+void MeshStream::rewind()
+{
+    cursor_ = 0;
+}
+
+int MeshStream::nfaces()
+{
+    return header_.nfaces;
+}
+
+Vec3f MeshStream::bbox_min()
+{
+    return Vec3f(header_.bbox_min[0], header_.bbox_min[1], header_.bbox_min[2]);
+}
+
+Vec3f MeshStream::bbox_max()
+{
+    return Vec3f(header_.bbox_max[0], header_.bbox_max[1], header_.bbox_max[2]);
+}
+
+int MeshStream::chunk_faces()
+{
+    return chunk_faces_;
+}
+
+size_t MeshStream::peak_bytes()
+{
+    return peak_;
+}
+
+size_t MeshStream::budget_bytes()
+{
+    return budget_;
+}
+
+Model& MeshStream::chunk()
+{
+    return *chunk_;
+}
@@ -0,0 +1,109 @@
+﻿#pragma once
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "framebuffer.h"
+#include "geometry.h"
+#include "meshfile.h"
+#include "model.h"
+#include "shader.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Out-of-core access to a mesh too large to load as a Model.
+ * The obj is converted once, a line at a time, to the binary mesh file; rendering then reads it a chunk of
+ * faces at a time into a small Model holding only the vertices those faces use, so the shaders and DrawModel
+ * work on it unchanged. Memory for a chunk is bounded by the budget given to the constructor.
+ */
+class MeshStream
+{
+public:
+    static const size_t DEFAULT_BUDGET = 64 << 20;
+
+    explicit MeshStream(size_t budget_bytes = DEFAULT_BUDGET);
+    ~MeshStream();
+
+    /**
+     * \brief Open an obj through its <obj>.stream.mesh file, converting it when missing or stale, or a .mesh file
+     * directly. Textures are looked up next to the obj like Model does.
+     */
+    bool open(const char* filename);
+
+    /**
+     * \brief Load the next chunk of faces
+     * \return null after the last chunk, call rewind() to stream the mesh again
+     */
+    Model* next();
+
+    void rewind();
+
+    int nfaces();
+    Vec3f bbox_min();
+    Vec3f bbox_max();
+
+    // faces per chunk, derived from the budget
+    int chunk_faces();
+
+    // largest memory held for a chunk so far, in bytes
+    size_t peak_bytes();
+    size_t budget_bytes();
+
+    // the chunk Model, valid between next() calls; also holds the textures
+    Model& chunk();
+
+    /**
+     * \brief Convert an obj to a mesh file with memory independent of the mesh size
+     */
+    static bool convert(const char* obj, const std::string& mesh);
+
+private:
+    // read the entries of a section at the sorted indices, coalescing nearby ones into one read
+    void read_rows(long long offset, size_t size, const std::vector<int>& indices, char* out);
+
+    size_t budget_;
+    size_t peak_;
+    int chunk_faces_;
+    int cursor_;
+    std::ifstream in_;
+    MeshFileHeader header_;
+    std::unique_ptr<Model> chunk_;
+
+    // scratch, kept between chunks to avoid reallocating
+    std::vector<Vec3i> corners_;
+    std::vector<int> indices_[3];
+    std::vector<char> window_;
+};
+
+/**
+ * \brief Draw a single streamed mesh: every chunk goes through the shader and rasterizer in turn
+ */
+template <class Shader>
+void DrawStream(MeshStream& stream, const Matrix& transform, Vec3f light_dir, DepthBuffer& depth, TGAImage& image,
+                ShadowMap* shadow = nullptr)
+{
+    stream.rewind();
+    while (Model* chunk = stream.next())
+    {
+        Shader shader(chunk, transform, light_dir);
+        if (shadow)
+        {
+            Shadowed<Shader> shadowed(shader, shadow, shadow->transform);
+            DrawModel(*chunk, shadowed, depth, image);
+        }
+        else
+        {
+            DrawModel(*chunk, shader, depth, image);
+        }
+    }
+}
+
+inline void DrawStreamDepth(MeshStream& stream, const Matrix& transform, DepthBuffer& depth)
+{
+    stream.rewind();
+    while (Model* chunk = stream.next())
+    {
+        DepthShader shader(chunk, transform);
+        DrawModelDepth(*chunk, shader, depth);
+    }
+}
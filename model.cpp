@@ -1,21 +1,74 @@
 ﻿#include "model.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
 
-Model::Model(const char* filename)
+#include "meshfile.h"
+#include "meshopt.h"
+#include "simplify.h"
+#include "texturecache.h"
+
+Model::Model(const char* filename, bool optimize)
     : verts_(),
       faces_(),
-      uv_()
+      uv_(),
+      packed_(false),
+      loaded_(false)
+{
+    if (!optimize || !read_cache(filename))
+    {
+        if (!read_obj(filename))
+        {
+            std::cerr << "can't load model " << filename << std::endl;
+            // empty maps rather than null ones, so the texture accessors stay safe
+            diffusemap_ = std::make_shared<TGAImage>();
+            normalmap_ = std::make_shared<TGAImage>();
+            tangentnormalmap_ = std::make_shared<TGAImage>();
+            specularmap_ = std::make_shared<TGAImage>();
+            return;
+        }
+        if (optimize)
+        {
+            optimize_mesh();
+            write_cache(filename);
+        }
+    }
+    std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << std::endl;
+    loaded_ = true;
+    compute_bounds();
+    diffusemap_ = load_texture(filename, 0);
+    normalmap_ = load_texture(filename, 1);
+    tangentnormalmap_ = load_texture(filename, 2);
+    specularmap_ = load_texture(filename, 3);
+}
+
+Model::Model()
+    : packed_(false),
+      loaded_(true)
+{
+}
+
+bool Model::loaded()
+{
+    return loaded_;
+}
+
+Model::~Model()
+{
+}
+
+bool Model::read_obj(const char* filename)
 {
     // Use istream to read the file
     std::ifstream in;
     in.open(filename, std::ifstream::in);
     if (in.fail())
     {
-        return;
+        return false;
     }
 
     std::string line;
@@ -82,17 +135,380 @@ Model::Model(const char* filename)
             norm_.push_back(n);
         }
     }
-    std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
+    return true;
 }
 
-Model::~Model()
+bool Model::read_cache(const char* filename)
+{
+    std::ifstream in(mesh_file_path(filename).c_str(), std::ios::binary);
+    if (in.fail())
+    {
+        return false;
+    }
+    MeshFileHeader header;
+    if (!read_mesh_header(in, filename, header) || !(header.flags & MESH_FILE_OPTIMIZED))
+    {
+        return false;
+    }
+
+    verts_.resize(header.nverts);
+    uv_.resize(header.nuv);
+    norm_.resize(header.nnorm);
+    std::vector<Vec3i> corners(header.nfaces * 3);
+    in.read(reinterpret_cast<char*>(verts_.data()), verts_.size() * sizeof(Vec3f));
+    in.read(reinterpret_cast<char*>(uv_.data()), uv_.size() * sizeof(Vec2f));
+    in.read(reinterpret_cast<char*>(norm_.data()), norm_.size() * sizeof(Vec3f));
+    in.read(reinterpret_cast<char*>(corners.data()), corners.size() * sizeof(Vec3i));
+    if (!in)
+    {
+        verts_.clear();
+        uv_.clear();
+        norm_.clear();
+        return false;
+    }
+    faces_.assign(header.nfaces, std::vector<Vec3i>(3));
+    for (int i = 0; i < header.nfaces; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            faces_[i][j] = corners[i * 3 + j];
+        }
+    }
+    std::cerr << "mesh cache " << mesh_file_path(filename) << " loading ok" << std::endl;
+    return true;
+}
+
+void Model::write_cache(const char* filename)
+{
+    MeshFileHeader header;
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    header.flags = MESH_FILE_OPTIMIZED;
+    header.nverts = (int)verts_.size();
+    header.nuv = (int)uv_.size();
+    header.nnorm = (int)norm_.size();
+    header.nfaces = (int)faces_.size();
+    std::vector<Vec3i> corners;
+    corners.reserve(faces_.size() * 3);
+    for (const auto& face : faces_)
+    {
+        if (face.size() != 3)
+        {
+            // only triangle meshes are cached
+            return;
+        }
+        corners.insert(corners.end(), face.begin(), face.end());
+    }
+    if (!mesh_file_stamp(filename, header.source_size, header.source_mtime))
+    {
+        return;
+    }
+    compute_bounds();
+    for (int i = 0; i < 3; ++i)
+    {
+        header.bbox_min[i] = bboxmin_.raw[i];
+        header.bbox_max[i] = bboxmax_.raw[i];
+    }
+
+    std::ofstream out(mesh_file_path(filename).c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(verts_.data()), verts_.size() * sizeof(Vec3f));
+    out.write(reinterpret_cast<const char*>(uv_.data()), uv_.size() * sizeof(Vec2f));
+    out.write(reinterpret_cast<const char*>(norm_.data()), norm_.size() * sizeof(Vec3f));
+    out.write(reinterpret_cast<const char*>(corners.data()), corners.size() * sizeof(Vec3i));
+    if (!out)
+    {
+        std::cerr << "can't write mesh cache " << mesh_file_path(filename) << std::endl;
+    }
+}
+
+void Model::optimize_mesh()
+{
+    const int nfaces = (int)faces_.size();
+    for (const auto& face : faces_)
+    {
+        if (face.size() != 3)
+        {
+            return;
+        }
+    }
+
+    std::vector<int> indices(nfaces * 3);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            indices[i * 3 + j] = faces_[i][j].ivert;
+        }
+    }
+    const float before = vertex_cache_acmr(indices, (int)verts_.size());
+
+    // triangle order for the post-transform cache
+    std::vector<int> order = optimize_vertex_cache(indices, (int)verts_.size());
+    std::vector<std::vector<Vec3i>> faces(nfaces);
+    for (int i = 0; i < nfaces; ++i)
+    {
+        faces[i].swap(faces_[order[i]]);
+        for (int j = 0; j < 3; ++j)
+        {
+            indices[i * 3 + j] = faces[i][j].ivert;
+        }
+    }
+    faces_.swap(faces);
+    const float after = vertex_cache_acmr(indices, (int)verts_.size());
+
+    // then each attribute array in order of first use, raw[] of a corner is (ivert, iuv, inorm)
+    reorder_stream(verts_, 0);
+    reorder_stream(uv_, 1);
+    reorder_stream(norm_, 2);
+
+    std::cerr << "# acmr " << before << " -> " << after << std::endl;
+}
+
+void Model::compact()
+{
+    reorder_stream(verts_, 0);
+    reorder_stream(uv_, 1);
+    reorder_stream(norm_, 2);
+    // used entries come first now
+    Vec3i used(-1, -1, -1);
+    for (const auto& face : faces_)
+    {
+        for (const Vec3i& corner : face)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                used.raw[i] = std::max(used.raw[i], corner.raw[i]);
+            }
+        }
+    }
+    verts_.resize(std::min((int)verts_.size(), used.ivert + 1));
+    uv_.resize(std::min((int)uv_.size(), used.iuv + 1));
+    norm_.resize(std::min((int)norm_.size(), used.inorm + 1));
+}
+
+template <class T>
+void Model::reorder_stream(std::vector<T>& values, int component)
+{
+    std::vector<int> indices;
+    indices.reserve(faces_.size() * 3);
+    for (const auto& face : faces_)
+    {
+        for (const Vec3i& corner : face)
+        {
+            if (corner.raw[component] < 0 || corner.raw[component] >= (int)values.size())
+            {
+                // dangling index, leave the stream alone
+                return;
+            }
+            indices.push_back(corner.raw[component]);
+        }
+    }
+    std::vector<int> order = optimize_vertex_fetch(indices, (int)values.size());
+    std::vector<T> reordered(values.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        reordered[i] = values[order[i]];
+    }
+    values.swap(reordered);
+    size_t k = 0;
+    for (auto& face : faces_)
+    {
+        for (Vec3i& corner : face)
+        {
+            corner.raw[component] = indices[k++];
+        }
+    }
+}
+
+void Model::compute_bounds()
+{
+    bboxmin_ = verts_.empty() ? Vec3f() : verts_[0];
+    bboxmax_ = bboxmin_;
+    for (const Vec3f& v : verts_)
+    {
+        bboxmin_ = Vec3f(std::min(bboxmin_.x, v.x), std::min(bboxmin_.y, v.y), std::min(bboxmin_.z, v.z));
+        bboxmax_ = Vec3f(std::max(bboxmax_.x, v.x), std::max(bboxmax_.y, v.y), std::max(bboxmax_.z, v.z));
+    }
+}
+
+Vec3f Model::bbox_min()
+{
+    return bboxmin_;
+}
+
+Vec3f Model::bbox_max()
+{
+    return bboxmax_;
+}
+
+void Model::build_bvh()
+{
+    bvh_.reset(new BVH());
+    bvh_->build(*this);
+}
+
+BVH* Model::bvh()
 {
+    return bvh_.get();
+}
+
+void Model::build_clusters(int max_faces)
+{
+    clusters_.reset(new ClusterSet());
+    clusters_->build(*this, max_faces);
+}
+
+ClusterSet* Model::clusters()
+{
+    return clusters_.get();
+}
+
+void Model::build_edges()
+{
+    // smaller index in the high half, so sorting groups each edge's copies whatever the face winding
+    std::vector<unsigned long long> keys;
+    keys.reserve((size_t)nfaces() * 3);
+    for (int i = 0; i < nfaces(); ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            unsigned long long a = (unsigned)vert_index(i, j);
+            unsigned long long b = (unsigned)vert_index(i, (j + 1) % 3);
+            keys.push_back(a < b ? a << 32 | b : b << 32 | a);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    edges_.clear();
+    edges_.reserve(keys.size());
+    for (unsigned long long key : keys)
+    {
+        edges_.push_back(Vec2i((int)(key >> 32), (int)(key & 0xffffffffu)));
+    }
+}
+
+const std::vector<Vec2i>& Model::edges()
+{
+    return edges_;
+}
+
+void Model::build_lods(int levels)
+{
+    if (packed_)
+    {
+        std::cerr << "levels of detail need the unpacked mesh\n";
+        return;
+    }
+    lods_.clear();
+    std::vector<Vec3i> corners;
+    corners.reserve(faces_.size() * 3);
+    for (const auto& face : faces_)
+    {
+        if (face.size() != 3)
+        {
+            return;
+        }
+        corners.insert(corners.end(), face.begin(), face.end());
+    }
+
+    // every level simplifies the previous one further, indices stay those of this model's arrays
+    for (int level = 0; level < levels; ++level)
+    {
+        const int previous = (int)corners.size() / 3;
+        simplify_mesh(verts_, corners, previous / 2);
+        const int nfaces = (int)corners.size() / 3;
+        if (nfaces == 0 || nfaces >= previous)
+        {
+            break;
+        }
+
+        std::unique_ptr<Model> lod(new Model());
+        lod->verts_ = verts_;
+        lod->uv_ = uv_;
+        lod->norm_ = norm_;
+        lod->faces_.resize(nfaces);
+        for (int i = 0; i < nfaces; ++i)
+        {
+            lod->faces_[i].assign(corners.begin() + i * 3, corners.begin() + i * 3 + 3);
+        }
+        lod->compact();
+        lod->compute_bounds();
+        lod->diffusemap_ = diffusemap_;
+        lod->normalmap_ = normalmap_;
+        lod->tangentnormalmap_ = tangentnormalmap_;
+        lod->specularmap_ = specularmap_;
+        if (bvh_)
+        {
+            lod->build_bvh();
+        }
+        lods_.push_back(std::move(lod));
+    }
+}
+
+void Model::pack()
+{
+    for (auto& lod : lods_)
+    {
+        lod->pack();
+    }
+    if (packed_)
+    {
+        return;
+    }
+
+    const size_t before = verts_.size() * sizeof(Vec3f) + uv_.size() * sizeof(Vec2f) + norm_.size() * sizeof(Vec3f);
+    quantizer_ = PositionQuantizer(bboxmin_, bboxmax_);
+    packed_verts_.resize(verts_.size());
+    for (size_t i = 0; i < verts_.size(); ++i)
+    {
+        packed_verts_[i] = quantizer_.encode(verts_[i]);
+    }
+    packed_uv_.resize(uv_.size());
+    for (size_t i = 0; i < uv_.size(); ++i)
+    {
+        packed_uv_[i] = encode_uv(uv_[i]);
+    }
+    packed_norm_.resize(norm_.size());
+    for (size_t i = 0; i < norm_.size(); ++i)
+    {
+        packed_norm_[i] = encode_normal(norm_[i]);
+    }
+    // swapping with empty vectors releases the memory, clear() would keep it
+    std::vector<Vec3f>().swap(verts_);
+    std::vector<Vec2f>().swap(uv_);
+    std::vector<Vec3f>().swap(norm_);
+    packed_ = true;
+
+    const size_t after = packed_verts_.size() * sizeof(PackedPosition) + packed_uv_.size() * sizeof(PackedUV) +
+        packed_norm_.size() * sizeof(PackedNormal);
+    std::cerr << "# packed attributes " << before / 1024 << "KB -> " << after / 1024 << "KB\n";
+}
+
+bool Model::packed()
+{
+    return packed_;
+}
+
+int Model::nlods()
+{
+    return (int)lods_.size() + 1;
+}
+
+Model* Model::lod(int level)
+{
+    return level == 0 ? this : lods_[level - 1].get();
 }
 
 int Model::nverts()
 {
-    return (int)verts_.size();
+    return packed_ ? (int)packed_verts_.size() : (int)verts_.size();
+}
+
+int Model::nnorms()
+{
+    return packed_ ? (int)packed_norm_.size() : (int)norm_.size();
 }
 
 int Model::nfaces()
@@ -102,7 +518,7 @@ int Model::nfaces()
 
 Vec3f Model::vert(int idx)
 {
-    return verts_[idx];
+    return packed_ ? quantizer_.decode(packed_verts_[idx]) : verts_[idx];
 }
 
 std::vector<Vec3i> Model::face(int idx)
@@ -112,29 +528,108 @@ std::vector<Vec3i> Model::face(int idx)
 
 Vec2f Model::uv(int idx)
 {
-    return uv_[idx];
+    return packed_ ? decode_uv(packed_uv_[idx]) : uv_[idx];
 }
 
 Vec3f Model::norm(int idx)
 {
-    return norm_[idx].normalize();
+    // normalize a copy, the model is read by several pipeline stages at once
+    Vec3f n = packed_ ? decode_normal(packed_norm_[idx]) : norm_[idx];
+    return n.normalize();
+}
+
+Vec3f Model::vert(int iface, int nthvert)
+{
+    return vert(faces_[iface][nthvert].ivert);
 }
 
-void Model::load_texture(std::string filename, const char* suffix, TGAImage& img)
+Vec2f Model::uv(int iface, int nthvert)
+{
+    return uv(faces_[iface][nthvert].iuv);
+}
+
+Vec3f Model::norm(int iface, int nthvert)
+{
+    return norm(faces_[iface][nthvert].inorm);
+}
+
+int Model::vert_index(int iface, int nthvert)
+{
+    return faces_[iface][nthvert].ivert;
+}
+
+int Model::norm_index(int iface, int nthvert)
+{
+    return faces_[iface][nthvert].inorm;
+}
+
+// passed by reference to make_shared by the AssetLoader, so the constant needs its definition
+const int Model::NTEXTURES;
+const char* const Model::TEXTURE_SUFFIXES[NTEXTURES] = {"_diffuse.tga", "_nm.tga", "_nm_tangent.tga", "_spec.tga"};
+
+std::string Model::texture_path(std::string filename, const char* suffix)
 {
     std::string textfile(filename);
     auto dot = textfile.find_last_of(".");
     if (dot != std::string::npos)
     {
-        textfile = textfile.substr(0, dot) + std::string(suffix);
-        std::cerr << "texture file " << textfile << " loading " << (img.read_tga_file(textfile.c_str())
-                                                                        ? "ok"
-                                                                        : "failed") << endl;
-        img.flip_vertically();
+        textfile = textfile.substr(0, dot);
     }
+    return textfile + std::string(suffix);
+}
+
+std::shared_ptr<TGAImage> Model::load_texture(std::string filename, int texture)
+{
+    return TextureCache::instance().load(texture_path(filename, TEXTURE_SUFFIXES[texture]),
+                                         texture >= REQUIRED_TEXTURES);
 }
 
 TGAColor Model::diffuse(Vec2f uv)
 {
-    return diffusemap_.get(uv.x * diffusemap_.get_width(), uv.y * diffusemap_.get_height());
+    return diffusemap_->get(uv.x * diffusemap_->get_width(), uv.y * diffusemap_->get_height());
+}
+
+namespace
+{
+    Vec3f decode_normal(TGAColor c)
+    {
+        Vec3f n;
+        // tga stores bgr
+        for (int i = 0; i < 3; ++i)
+        {
+            n.raw[2 - i] = c.raw[i] / 255.f * 2.f - 1.f;
+        }
+        return n;
+    }
+}
+
+Vec3f Model::normal(Vec2f uv)
+{
+    return decode_normal(normalmap_->get(uv.x * normalmap_->get_width(), uv.y * normalmap_->get_height()));
+}
+
+Vec3f Model::normal_tangent(Vec2f uv)
+{
+    return decode_normal(tangentnormalmap_->get(uv.x * tangentnormalmap_->get_width(),
+                                                uv.y * tangentnormalmap_->get_height()));
+}
+
+float Model::specular(Vec2f uv)
+{
+    return specularmap_->get(uv.x * specularmap_->get_width(), uv.y * specularmap_->get_height()).raw[0];
+}
+
+bool Model::has_normalmap()
+{
+    return normalmap_->buffer() != nullptr;
+}
+
+bool Model::has_tangent_normalmap()
+{
+    return tangentnormalmap_->buffer() != nullptr;
+}
+
+bool Model::has_specularmap()
+{
+    return specularmap_->buffer() != nullptr;
 }
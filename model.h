@@ -1,15 +1,74 @@
 ﻿#pragma once
+#include <memory>
+#include <string>
 #include <vector>
+#include "bvh.h"
+#include "cluster.h"
 #include "geometry.h"
+#include "packedvertex.h"
 #include "tgaimage.h"
 
 class Model
 {
 public:
-    Model(const char* filename);
+    /**
+     * \param optimize Reorder faces and vertices for the vertex cache and fetch order, see meshopt.h.
+     * The result is cached in <filename>.mesh and reused while the obj is unchanged.
+     */
+    Model(const char* filename, bool optimize = false);
     ~Model();
 
+    // false when the obj couldn't be read, the model is then empty
+    bool loaded();
+
+    // object space axis aligned bounds of the vertices
+    Vec3f bbox_min();
+    Vec3f bbox_max();
+
+    /**
+     * \brief Build the face hierarchy used for culling and picking
+     */
+    void build_bvh();
+
+    // null until build_bvh was called
+    BVH* bvh();
+
+    /**
+     * \brief Split the faces into clusters with bounding spheres and normal cones, see ClusterSet
+     */
+    void build_clusters(int max_faces = ClusterSet::DEFAULT_CLUSTER_FACES);
+
+    // null until build_clusters was called
+    ClusterSet* clusters();
+
+    /**
+     * \brief Collect the edges of the faces, each edge shared by several faces once, for wireframe drawing
+     */
+    void build_edges();
+
+    // pairs of vertex indices, empty until build_edges was called
+    const std::vector<Vec2i>& edges();
+
+    /**
+     * \brief Generate up to levels simplified versions of the mesh, each with about half the faces of the
+     * previous one, see simplify_mesh. They share this model's textures.
+     */
+    void build_lods(int levels);
+
+    /**
+     * \brief Switch the vertex attributes to the compact formats of packedvertex.h and free the float arrays.
+     * The levels of detail are packed along. Call it after build_lods, which works on the float positions.
+     */
+    void pack();
+    bool packed();
+
+    // number of levels of detail including the model itself
+    int nlods();
+    // level 0 is the model itself, higher levels are coarser
+    Model* lod(int level);
+
     int nverts();
+    int nnorms();
     int nfaces();
     Vec3f vert(int idx);
     // return the index of vertices, uv, and normal
@@ -17,11 +76,67 @@ public:
     Vec2f uv(int idx);
     Vec3f norm(int idx);
 
-    void load_texture(std::string filename, const char* suffix, TGAImage& img);
+    // per face-corner accessors, avoid copying the face
+    Vec3f vert(int iface, int nthvert);
+    Vec2f uv(int iface, int nthvert);
+    Vec3f norm(int iface, int nthvert);
+    // index into the vertex and normal arrays of a face corner
+    int vert_index(int iface, int nthvert);
+    int norm_index(int iface, int nthvert);
+
+    // companion textures looked up next to the obj: diffuse, object space normals, tangent space normals, specular
+    static const int NTEXTURES = 4;
+    static const char* const TEXTURE_SUFFIXES[NTEXTURES];
+    // only the first ones, the diffuse map, are expected next to every obj; the others are skipped when missing
+    static const int REQUIRED_TEXTURES = 1;
+
+    // <obj name without extension><suffix>
+    static std::string texture_path(std::string filename, const char* suffix);
+
+    /**
+     * \brief Load the companion texture <obj name><TEXTURE_SUFFIXES[texture]> through the shared TextureCache
+     */
+    std::shared_ptr<TGAImage> load_texture(std::string filename, int texture);
 
     TGAColor diffuse(Vec2f uv);
 
+    /**
+     * \brief Object space normal from the _nm normal map, decoded from [0, 255] to [-1, 1]
+     */
+    Vec3f normal(Vec2f uv);
+
+    /**
+     * \brief Tangent space normal from the _nm_tangent normal map, decoded from [0, 255] to [-1, 1]
+     */
+    Vec3f normal_tangent(Vec2f uv);
+
+    /**
+     * \brief Specular exponent from the _spec map
+     */
+    float specular(Vec2f uv);
+
+    bool has_normalmap();
+    bool has_tangent_normalmap();
+    bool has_specularmap();
+
 private:
+    // fills chunk models a part of a mesh file at a time
+    friend class MeshStream;
+
+    // empty model, filled in by build_lods and MeshStream
+    Model();
+
+    bool read_obj(const char* filename);
+    bool read_cache(const char* filename);
+    void write_cache(const char* filename);
+    void optimize_mesh();
+    // renumber one attribute array in order of first use, component selects ivert, iuv or inorm of the face corners
+    template <class T>
+    void reorder_stream(std::vector<T>& values, int component);
+    // drop attribute entries no face uses, renumbering the rest in order of first use
+    void compact();
+    void compute_bounds();
+
     std::vector<Vec3f> verts_;
     // faces_ stores the index of vertices, uv, and normal -> Vec3i
     std::vector<std::vector<Vec3i>> faces_;
@@ -29,6 +144,26 @@ private:
     std::vector<Vec2f> uv_;
 
     std::vector<Vec3f> norm_;
-    // diffuse map
-    TGAImage diffusemap_;
+    // replace verts_, uv_ and norm_ once pack() was called
+    bool packed_;
+    PositionQuantizer quantizer_;
+    std::vector<PackedPosition> packed_verts_;
+    std::vector<PackedUV> packed_uv_;
+    std::vector<PackedNormal> packed_norm_;
+    bool loaded_;
+    // textures are shared with every other model using the same files, see TextureCache
+    std::shared_ptr<TGAImage> diffusemap_;
+    // object space normal map
+    std::shared_ptr<TGAImage> normalmap_;
+    // tangent space normal map
+    std::shared_ptr<TGAImage> tangentnormalmap_;
+    std::shared_ptr<TGAImage> specularmap_;
+
+    Vec3f bboxmin_;
+    Vec3f bboxmax_;
+
+    std::unique_ptr<BVH> bvh_;
+    std::unique_ptr<ClusterSet> clusters_;
+    std::vector<Vec2i> edges_;
+    std::vector<std::unique_ptr<Model>> lods_;
 };
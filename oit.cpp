@@ -0,0 +1,89 @@
+﻿#include "oit.h"
+
+#include <algorithm>
+
+FragmentBuffer::FragmentBuffer(int w, int h, size_t capacity)
+    : heads_((size_t)w * h, -1),
+      arena_(capacity ? capacity : (size_t)w * h * DEFAULT_FRAGMENTS_PER_PIXEL),
+      count_(0),
+      overflow_(0),
+      width_(w),
+      height_(h)
+{
+}
+
+void FragmentBuffer::clear()
+{
+    if (count_ > 0)
+    {
+        std::fill(heads_.begin(), heads_.end(), -1);
+    }
+    count_ = 0;
+    overflow_ = 0;
+}
+
+void FragmentBuffer::resolve(TGAImage& image)
+{
+    if (count_ == 0)
+    {
+        return;
+    }
+    const int bytespp = image.get_bytespp();
+    unsigned char* pixels = image.buffer();
+    const Fragment* layers[MAX_LAYERS];
+    for (size_t i = 0; i < heads_.size(); ++i)
+    {
+        if (heads_[i] < 0)
+        {
+            continue;
+        }
+
+        // gather the closest MAX_LAYERS fragments, sorted farthest first
+        int n = 0;
+        for (int f = heads_[i]; f >= 0; f = arena_[f].next)
+        {
+            const Fragment* fragment = &arena_[f];
+            if (n == MAX_LAYERS)
+            {
+                if (fragment->z <= layers[0]->z)
+                {
+                    continue;
+                }
+                // drop the farthest
+                std::copy(layers + 1, layers + n, layers);
+                --n;
+            }
+            int j = n++;
+            for (; j > 0 && layers[j - 1]->z > fragment->z; --j)
+            {
+                layers[j] = layers[j - 1];
+            }
+            layers[j] = fragment;
+        }
+
+        unsigned char* px = pixels + i * bytespp;
+        for (int l = 0; l < n; ++l)
+        {
+            const int alpha = layers[l]->color[3];
+            for (int c = 0; c < bytespp; ++c)
+            {
+                px[c] = (unsigned char)((layers[l]->color[c] * alpha + px[c] * (255 - alpha) + 127) / 255);
+            }
+        }
+    }
+}
+
+size_t FragmentBuffer::count()
+{
+    return count_;
+}
+
+size_t FragmentBuffer::overflow()
+{
+    return overflow_;
+}
+
+size_t FragmentBuffer::capacity()
+{
+    return arena_.size();
+}
@@ -0,0 +1,83 @@
+﻿#pragma once
+#include <cstddef>
+#include <vector>
+#include "tgaimage.h"
+
+/**
+ * \brief Per-pixel linked lists of transparent fragments for order-independent transparency.
+ * Transparent triangles are drawn in any order, depth tested against the opaque geometry but without writing depth,
+ * and each of their fragments is pushed onto the list of its pixel. resolve() then sorts every list back to front and
+ * blends it over the opaque image.
+ * The fragments live in an arena allocated once for the whole buffer, clear() only rewinds it. Fragments that don't
+ * fit any more are dropped and counted.
+ */
+class FragmentBuffer
+{
+public:
+    // arena size per pixel when none is given
+    static const int DEFAULT_FRAGMENTS_PER_PIXEL = 4;
+    // most layers blended per pixel, the closest ones are kept
+    static const int MAX_LAYERS = 16;
+
+    /**
+     * \param capacity Fragments the arena holds, 0 for DEFAULT_FRAGMENTS_PER_PIXEL per pixel
+     */
+    FragmentBuffer(int w, int h, size_t capacity = 0);
+
+    // empty every list, O(pixels) only after frames that had fragments
+    void clear();
+
+    /**
+     * \brief Push a fragment on the list of pixel (x, y)
+     * \param z Depth of the fragment, bigger is closer
+     * \return false when the arena is full and the fragment was dropped
+     */
+    inline bool add(int x, int y, int z, const TGAColor& color)
+    {
+        if (count_ == arena_.size())
+        {
+            ++overflow_;
+            return false;
+        }
+        int& head = heads_[x + y * width_];
+        Fragment& fragment = arena_[count_];
+        fragment.z = z;
+        fragment.next = head;
+        for (int c = 0; c < 4; ++c)
+        {
+            fragment.color[c] = color.raw[c];
+        }
+        head = (int)count_++;
+        return true;
+    }
+
+    /**
+     * \brief Blend every pixel's fragments over image, farthest first
+     * \param image The opaque render, same size as the buffer. The lists are kept until clear().
+     */
+    void resolve(TGAImage& image);
+
+    // fragments stored since the last clear()
+    size_t count();
+
+    // fragments dropped since the last clear() because the arena was full
+    size_t overflow();
+
+    size_t capacity();
+
+private:
+    struct Fragment
+    {
+        int z;
+        // index of the next fragment of the same pixel, -1 ends the list
+        int next;
+        unsigned char color[4];
+    };
+
+    std::vector<int> heads_;
+    std::vector<Fragment> arena_;
+    size_t count_;
+    size_t overflow_;
+    int width_;
+    int height_;
+};
@@ -0,0 +1,167 @@
+﻿#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "geometry.h"
+
+/**
+ * \brief Compact vertex attribute formats for Model::pack(), decoded by the accessors in the vertex stage.
+ *   positions - 3 x 16 bits, quantized over the mesh bounds, 6 bytes instead of 12
+ *   normals   - octahedral encoding, 2 x 16 bits signed, 4 bytes instead of 12
+ *   uvs       - 2 half floats, 4 bytes instead of 8
+ */
+struct PackedPosition
+{
+    unsigned short x;
+    unsigned short y;
+    unsigned short z;
+};
+
+struct PackedNormal
+{
+    short x;
+    short y;
+};
+
+struct PackedUV
+{
+    unsigned short u;
+    unsigned short v;
+};
+
+/**
+ * \brief Maps the bounds of a mesh onto the 16 bit position grid and back
+ */
+struct PositionQuantizer
+{
+    PositionQuantizer(): origin(), step(1.f, 1.f, 1.f), inv_step(1.f, 1.f, 1.f)
+    {
+    }
+
+    PositionQuantizer(Vec3f lo, Vec3f hi): origin(lo)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            const float extent = hi.raw[i] - lo.raw[i];
+            step.raw[i] = extent > 0.f ? extent / 65535.f : 1.f;
+            inv_step.raw[i] = 1.f / step.raw[i];
+        }
+    }
+
+    inline PackedPosition encode(const Vec3f& v) const
+    {
+        unsigned short q[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            const float t = (v.raw[i] - origin.raw[i]) * inv_step.raw[i] + .5f;
+            q[i] = (unsigned short)std::min(std::max(t, 0.f), 65535.f);
+        }
+        return PackedPosition{q[0], q[1], q[2]};
+    }
+
+    inline Vec3f decode(const PackedPosition& p) const
+    {
+        return Vec3f(origin.x + p.x * step.x, origin.y + p.y * step.y, origin.z + p.z * step.z);
+    }
+
+    Vec3f origin;
+    // size of one quantization step per axis, at most half of it is lost
+    Vec3f step;
+    Vec3f inv_step;
+};
+
+/**
+ * \brief Project the unit normal onto the octahedron |x| + |y| + |z| = 1 and unfold the lower half over the
+ * corners of the square, the two remaining coordinates are stored as 16 bit signed normalized values
+ */
+inline PackedNormal encode_normal(Vec3f n)
+{
+    const float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+    if (l1 == 0.f)
+    {
+        return PackedNormal{0, 0};
+    }
+    float u = n.x / l1;
+    float v = n.y / l1;
+    if (n.z < 0.f)
+    {
+        const float fu = (1.f - std::fabs(v)) * (u >= 0.f ? 1.f : -1.f);
+        const float fv = (1.f - std::fabs(u)) * (v >= 0.f ? 1.f : -1.f);
+        u = fu;
+        v = fv;
+    }
+    return PackedNormal{(short)std::lround(std::min(std::max(u, -1.f), 1.f) * 32767.f),
+                        (short)std::lround(std::min(std::max(v, -1.f), 1.f) * 32767.f)};
+}
+
+// unnormalized, the caller normalizes anyway
+inline Vec3f decode_normal(const PackedNormal& p)
+{
+    float u = p.x * (1.f / 32767.f);
+    float v = p.y * (1.f / 32767.f);
+    const float z = 1.f - std::fabs(u) - std::fabs(v);
+    // folding the lower half back is branch free: t is 0 on the upper half
+    const float t = std::max(-z, 0.f);
+    u += u >= 0.f ? -t : t;
+    v += v >= 0.f ? -t : t;
+    return Vec3f(u, v, z);
+}
+
+/**
+ * \brief IEEE 754 binary16 from a float, rounded to nearest, overflowing to infinity
+ */
+inline unsigned short float_to_half(float f)
+{
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    const unsigned short sign = (unsigned short)((bits >> 16) & 0x8000);
+    const int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffff;
+    if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+        return sign | 0x7e00;
+    }
+    if (exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0)
+    {
+        // subnormal half, or zero below half the smallest one
+        if (exponent < -10)
+        {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        return sign | (unsigned short)((mantissa + (1u << (shift - 1))) >> shift);
+    }
+    // a carry out of the mantissa rounds up into the exponent, which is the right result
+    return sign | (unsigned short)(((exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+
+inline float half_to_float(unsigned short h)
+{
+    const unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    const unsigned int exponent = (h >> 10) & 0x1f;
+    const unsigned int mantissa = h & 0x3ff;
+    if (exponent == 0)
+    {
+        const float value = mantissa * (1.f / 16777216.f);
+        return sign ? -value : value;
+    }
+    const unsigned int bits = sign | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23) | (mantissa << 13);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline PackedUV encode_uv(const Vec2f& uv)
+{
+    return PackedUV{float_to_half(uv.x), float_to_half(uv.y)};
+}
+
+inline Vec2f decode_uv(const PackedUV& p)
+{
+    return Vec2f(half_to_float(p.u), half_to_float(p.v));
+}
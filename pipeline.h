@@ -0,0 +1,187 @@
+﻿#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "framebuffer.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Fixed capacity FIFO between pipeline stages: push blocks while full, pop while empty
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity): capacity_(capacity), closed_(false)
+    {
+    }
+
+    /**
+     * \return false if the queue was closed
+     */
+    bool push(const T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]
+        {
+            return closed_ || items_.size() < capacity_;
+        });
+        if (closed_)
+        {
+            return false;
+        }
+        items_.push_back(value);
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /**
+     * \return false once the queue is closed and drained
+     */
+    bool pop(T& value)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]
+        {
+            return closed_ || !items_.empty();
+        });
+        if (items_.empty())
+        {
+            return false;
+        }
+        value = items_.front();
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // wake every waiting stage, pops drain what is left
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_;
+};
+
+/**
+ * \brief Color and depth target of one frame in flight
+ */
+struct FrameBuffers
+{
+    // the color buffers come from FramePool::frames(), so the next render of the same size reuses them
+    FrameBuffers(int width, int height)
+        : depth(width, height),
+          color(width, height, TGAImage::RGB, &FramePool::frames())
+    {
+    }
+
+    DepthBuffer depth;
+    TGAImage color;
+};
+
+/**
+ * \brief Three stage frame executor for multi-frame batches.
+ * While frame N rasterizes on the calling thread, frame N+1 runs its geometry stage and frame N-1 is encoded and
+ * written, each on its own thread; ThreadPool::instance() leaves a core to these two, see
+ * ThreadPool::PIPELINE_THREADS. Stages hand frames over through bounded queues, and rasterization alternates between
+ * a fixed set of framebuffers (two: double buffering) that are only reused once the encode stage has released them,
+ * so memory stays constant however many frames run.
+ * \tparam Job Per frame state passed from geometry to raster to encode, reused across frames
+ */
+template <class Job>
+class FramePipeline
+{
+public:
+    typedef std::function<void(int frame, Job& job)> GeometryStage;
+    typedef std::function<void(Job& job, FrameBuffers& target)> RasterStage;
+    typedef std::function<void(Job& job, FrameBuffers& target)> EncodeStage;
+
+    /**
+     * \param nbuffers Framebuffers in flight between raster and encode
+     * \param queue_depth Frames the geometry stage may run ahead of rasterization
+     */
+    FramePipeline(int width, int height, int nbuffers = 2, int queue_depth = 2)
+        : nbuffers_(nbuffers),
+          queue_depth_(queue_depth)
+    {
+        for (int i = 0; i < nbuffers; ++i)
+        {
+            buffers_.emplace_back(new FrameBuffers(width, height));
+        }
+        // every job can be in a queue or a stage at once without blocking the free list
+        for (int i = 0; i < nbuffers + queue_depth + 2; ++i)
+        {
+            jobs_.emplace_back(new Job());
+        }
+    }
+
+    void run(int nframes, const GeometryStage& geometry, const RasterStage& raster, const EncodeStage& encode)
+    {
+        typedef std::pair<Job*, FrameBuffers*> Rendered;
+        BoundedQueue<Job*> free_jobs(jobs_.size());
+        BoundedQueue<FrameBuffers*> free_buffers(buffers_.size());
+        BoundedQueue<Job*> to_raster(queue_depth_);
+        BoundedQueue<Rendered> to_encode(nbuffers_);
+        for (auto& job : jobs_)
+        {
+            free_jobs.push(job.get());
+        }
+        for (auto& buffer : buffers_)
+        {
+            free_buffers.push(buffer.get());
+        }
+
+        std::thread geometry_thread([&]
+        {
+            Job* job;
+            for (int frame = 0; frame < nframes && free_jobs.pop(job); ++frame)
+            {
+                geometry(frame, *job);
+                to_raster.push(job);
+            }
+            to_raster.close();
+        });
+        std::thread encode_thread([&]
+        {
+            Rendered rendered;
+            while (to_encode.pop(rendered))
+            {
+                encode(*rendered.first, *rendered.second);
+                free_buffers.push(rendered.second);
+                free_jobs.push(rendered.first);
+            }
+        });
+
+        Job* job;
+        FrameBuffers* target;
+        while (to_raster.pop(job) && free_buffers.pop(target))
+        {
+            raster(*job, *target);
+            to_encode.push(Rendered(job, target));
+        }
+        to_encode.close();
+        encode_thread.join();
+        free_jobs.close();
+        geometry_thread.join();
+    }
+
+private:
+    int nbuffers_;
+    int queue_depth_;
+    std::vector<std::unique_ptr<FrameBuffers>> buffers_;
+    std::vector<std::unique_ptr<Job>> jobs_;
+};
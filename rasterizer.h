@@ -0,0 +1,416 @@
+﻿#pragma once
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include "framebuffer.h"
+#include "geometry.h"
+#include "model.h"
+#include "oit.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Fixed-function fragment policy for DrawTriangle.
+ * Every feature is a template flag, so each combination compiles to its own loop with the disabled paths removed.
+ * \tparam DepthTest Test and write the z-buffer
+ * \tparam Textured Sample the model's diffuse map with the interpolated uv instead of using the flat color
+ * \tparam Lit Modulate by the interpolated per-vertex intensity
+ * \tparam Blend Alpha blend over the framebuffer instead of overwriting it
+ */
+template <bool DepthTest, bool Textured, bool Lit, bool Blend>
+struct RasterPolicy
+{
+    static const bool depth_test = DepthTest;
+    static const bool depth_write = DepthTest;
+    static const bool blend = Blend;
+    static const bool transparent = false;
+    static const bool color_write = true;
+    static const bool cull_back = false;
+
+    RasterPolicy(): color(255, 255, 255, 255), model(nullptr), uv(), intensity()
+    {
+    }
+
+    /**
+     * \param bar Barycentric coordinates of the fragment
+     * \param out Color to write
+     * \return false to discard the fragment
+     */
+    inline bool fragment(const Vec3f& bar, TGAColor& out)
+    {
+        out = color;
+        if (Textured)
+        {
+            Vec2f uvp = uv[0] * bar.x + uv[1] * bar.y + uv[2] * bar.z;
+            out = model->diffuse(uvp);
+        }
+        if (Lit)
+        {
+            float intensityp = intensity[0] * bar.x + intensity[1] * bar.y + intensity[2] * bar.z;
+            if (intensityp < 0.2f)
+            {
+                intensityp = 0.2f;
+            }
+            out = TGAColor(out.r * intensityp, out.g * intensityp, out.b * intensityp, out.a);
+        }
+        return true;
+    }
+
+    TGAColor color;
+    Model* model;
+    Vec2f uv[3];
+    float intensity[3];
+};
+
+typedef RasterPolicy<false, false, false, false> FlatPolicy;
+typedef RasterPolicy<true, false, false, false> DepthPolicy;
+typedef RasterPolicy<true, true, true, false> TexturedLitPolicy;
+
+/**
+ * \brief Hands a transparent fragment to the policy's FragmentBuffer, a no-op for other policies
+ */
+template <class Policy>
+inline void StoreFragment(Policy& policy, int x, int y, int z, const TGAColor& color, std::true_type)
+{
+    policy.fragments->add(x, y, z, color);
+}
+
+template <class Policy>
+inline void StoreFragment(Policy&, int, int, int, const TGAColor&, std::false_type)
+{
+}
+
+/**
+ * \brief Rasterize one screen space triangle with a fragment policy.
+ * The policy provides the compile time flags
+ *   depth_test  - test depth
+ *   depth_write - write depth where the test passes and fragment() keeps the pixel, off for transparent surfaces
+ *   color_write - call fragment() and write the color, off for depth-only passes
+ *   blend       - alpha blend instead of overwrite
+ *   transparent - push the colors to the policy's `FragmentBuffer* fragments` instead of the image, for OIT
+ *   cull_back   - drop triangles with clockwise screen winding
+ * and `bool fragment(const Vec3f& bar, TGAColor& color)`. Disabled features vanish from the loop.
+ * Pixels exactly on an edge belong to one triangle only, by the top-left rule, so blending never
+ * covers shared edges twice.
+ * The bounding box is walked in DepthBuffer::DEPTH_TILE tiles: tiles outside an edge are skipped without
+ * visiting their pixels, and with depth testing, tiles where the triangle is behind everything drawn are skipped too.
+ * \param pts Screen coordinates, z is the depth value (bigger is closer)
+ * \param depth Depth buffer, may be null when the policy doesn't depth test
+ * \param image Color target, may be null when the policy doesn't write color
+ * \param scissor Pixels outside of it are left alone, null for the whole target
+ */
+template <class Policy>
+void RasterizeTriangle(Vec3i* pts, Policy& policy, DepthBuffer* depth, TGAImage* image,
+                       const ScreenRect* scissor = nullptr)
+{
+    const int width = Policy::color_write ? image->get_width() : depth->get_width();
+    const int height = Policy::color_write ? image->get_height() : depth->get_height();
+    const int bytespp = Policy::color_write ? image->get_bytespp() : 0;
+    unsigned char* pixels = Policy::color_write ? image->buffer() : nullptr;
+
+    // not clipped against the near plane, triangles reaching behind it are dropped whole
+    if (pts[0].z == BEHIND_EYE || pts[1].z == BEHIND_EYE || pts[2].z == BEHIND_EYE)
+    {
+        return;
+    }
+
+    const ScreenRect clip = scissor ? *scissor : ScreenRect{0, 0, width - 1, height - 1};
+    int minx = std::max(clip.x0, std::min(pts[0].x, std::min(pts[1].x, pts[2].x)));
+    int miny = std::max(clip.y0, std::min(pts[0].y, std::min(pts[1].y, pts[2].y)));
+    int maxx = std::min(clip.x1, std::max(pts[0].x, std::max(pts[1].x, pts[2].x)));
+    int maxy = std::min(clip.y1, std::max(pts[0].y, std::max(pts[1].y, pts[2].y)));
+    if (minx > maxx || miny > maxy)
+    {
+        return;
+    }
+
+    // Edge functions: e_i(p) is twice the signed area of the sub-triangle opposite vertex i.
+    // They are affine in p, so stepping one pixel just adds a constant.
+    int area = (pts[1].x - pts[0].x) * (pts[2].y - pts[0].y) - (pts[1].y - pts[0].y) * (pts[2].x - pts[0].x);
+    if (area == 0 || (Policy::cull_back && area < 0))
+    {
+        return;
+    }
+    const int sign = area > 0 ? 1 : -1;
+    const float invarea = 1.f / (area * sign);
+
+    int stepx[3];
+    int stepy[3];
+    int origin[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vec3i& a = pts[(i + 1) % 3];
+        const Vec3i& b = pts[(i + 2) % 3];
+        stepx[i] = (a.y - b.y) * sign;
+        stepy[i] = (b.x - a.x) * sign;
+        origin[i] = ((b.x - a.x) * (miny - a.y) - (b.y - a.y) * (minx - a.x)) * sign;
+    }
+    // Top-left rule: only edges with the inside towards +x, or horizontal ones with the inside towards +y, keep
+    // the pixels on them. The others test against -1, the neighbour sharing the edge sees it the other way round.
+    int bias[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        bias[i] = stepx[i] > 0 || (stepx[i] == 0 && stepy[i] > 0) ? 0 : 1;
+        origin[i] -= bias[i];
+    }
+    const float z0 = (float)pts[0].z;
+    const float z1 = (float)pts[1].z;
+    const float z2 = (float)pts[2].z;
+    const int zclosest = std::max(pts[0].z, std::max(pts[1].z, pts[2].z));
+
+    const int tile = DepthBuffer::DEPTH_TILE;
+    for (int ty = miny / tile; ty <= maxy / tile; ++ty)
+    {
+        const int y0 = std::max(miny, ty * tile);
+        const int y1 = std::min(maxy, ty * tile + tile - 1);
+        for (int tx = minx / tile; tx <= maxx / tile; ++tx)
+        {
+            const int tilemin = Policy::depth_test ? depth->tile_min(tx, ty) : 0;
+            if (Policy::depth_test && zclosest < tilemin)
+            {
+                continue;
+            }
+
+            const int x0 = std::max(minx, tx * tile);
+            const int x1 = std::min(maxx, tx * tile + tile - 1);
+            int row[3];
+            bool outside = false;
+            for (int i = 0; i < 3; ++i)
+            {
+                row[i] = origin[i] + stepx[i] * (x0 - minx) + stepy[i] * (y0 - miny);
+                // largest value of the edge over the tile's corners
+                int emax = row[i] + std::max(0, stepx[i] * (x1 - x0)) + std::max(0, stepy[i] * (y1 - y0));
+                outside = outside || emax < 0;
+            }
+            if (outside)
+            {
+                continue;
+            }
+            if (Policy::depth_test && depth->tile_pending(tx, ty))
+            {
+                depth->init_tile(tx, ty, Policy::color_write ? image : nullptr);
+            }
+
+            // the tile's farthest depth only moves if one of the farthest pixels gets overwritten
+            bool farthest_written = false;
+            for (int y = y0; y <= y1; ++y)
+            {
+                int e0 = row[0];
+                int e1 = row[1];
+                int e2 = row[2];
+                int* zrow = Policy::depth_test ? depth->row(y) : nullptr;
+                unsigned char* crow = Policy::color_write ? pixels + (size_t)y * width * bytespp : nullptr;
+                for (int x = x0; x <= x1; ++x, e0 += stepx[0], e1 += stepx[1], e2 += stepx[2])
+                {
+                    if ((e0 | e1 | e2) < 0)
+                    {
+                        continue;
+                    }
+
+                    Vec3f bar((e0 + bias[0]) * invarea, (e1 + bias[1]) * invarea, (e2 + bias[2]) * invarea);
+                    int z = 0;
+                    if (Policy::depth_test)
+                    {
+                        z = (int)(z0 * bar.x + z1 * bar.y + z2 * bar.z);
+                        if (zrow[x] > z)
+                        {
+                            continue;
+                        }
+                    }
+
+                    TGAColor color;
+                    if (Policy::color_write && !policy.fragment(bar, color))
+                    {
+                        continue;
+                    }
+
+                    // only fragments the shader kept occlude what is drawn after them
+                    if (Policy::depth_test && Policy::depth_write)
+                    {
+                        farthest_written = farthest_written || zrow[x] == tilemin;
+                        zrow[x] = z;
+                    }
+
+                    if (!Policy::color_write)
+                    {
+                        continue;
+                    }
+
+                    if (Policy::transparent)
+                    {
+                        StoreFragment(policy, x, y, z, color, std::integral_constant<bool, Policy::transparent>());
+                        continue;
+                    }
+
+                    unsigned char* px = crow + x * bytespp;
+                    if (Policy::blend)
+                    {
+                        const int alpha = color.a;
+                        for (int c = 0; c < bytespp; ++c)
+                        {
+                            px[c] = (unsigned char)((color.raw[c] * alpha + px[c] * (255 - alpha) + 127) / 255);
+                        }
+                    }
+                    else
+                    {
+                        memcpy(px, color.raw, bytespp);
+                    }
+                }
+                for (int i = 0; i < 3; ++i)
+                {
+                    row[i] += stepy[i];
+                }
+            }
+            if (Policy::depth_test && farthest_written)
+            {
+                depth->update_tile(tx, ty);
+            }
+        }
+    }
+}
+
+/**
+ * \brief Cohen-Sutherland clipping of a screen space segment to rect, z is interpolated along
+ * \return false when the segment misses rect entirely
+ */
+inline bool ClipLine(Vec3i& a, Vec3i& b, const ScreenRect& rect)
+{
+    const int LEFT = 1;
+    const int RIGHT = 2;
+    const int BELOW = 4;
+    const int ABOVE = 8;
+    auto outcode = [&](float x, float y)
+    {
+        return (x < rect.x0 ? LEFT : x > rect.x1 ? RIGHT : 0) | (y < rect.y0 ? BELOW : y > rect.y1 ? ABOVE : 0);
+    };
+
+    float x0 = (float)a.x;
+    float y0 = (float)a.y;
+    float z0 = (float)a.z;
+    float x1 = (float)b.x;
+    float y1 = (float)b.y;
+    float z1 = (float)b.z;
+    int code0 = outcode(x0, y0);
+    int code1 = outcode(x1, y1);
+    while (code0 | code1)
+    {
+        if (code0 & code1)
+        {
+            return false;
+        }
+        // move the endpoint that is outside onto the boundary it crosses
+        const int code = code0 ? code0 : code1;
+        float t;
+        float x;
+        float y;
+        if (code & (ABOVE | BELOW))
+        {
+            y = (float)(code & ABOVE ? rect.y1 : rect.y0);
+            t = (y - y0) / (y1 - y0);
+            x = x0 + (x1 - x0) * t;
+        }
+        else
+        {
+            x = (float)(code & RIGHT ? rect.x1 : rect.x0);
+            t = (x - x0) / (x1 - x0);
+            y = y0 + (y1 - y0) * t;
+        }
+        const float z = z0 + (z1 - z0) * t;
+        if (code == code0)
+        {
+            x0 = x;
+            y0 = y;
+            z0 = z;
+            code0 = outcode(x0, y0);
+        }
+        else
+        {
+            x1 = x;
+            y1 = y;
+            z1 = z;
+            code1 = outcode(x1, y1);
+        }
+    }
+    a = Vec3i((int)(x0 + .5f), (int)(y0 + .5f), (int)z0);
+    b = Vec3i((int)(x1 + .5f), (int)(y1 + .5f), (int)z1);
+    return true;
+}
+
+/**
+ * \brief Bresenham line, clipped to the image first so off screen parts cost nothing, written straight into the
+ * pixel rows
+ * \tparam DepthTest Hide the parts behind the z-buffer, lines don't write depth. The buffer must be resolved.
+ * \param bias Added to the line's depth, so edges lying on the surface they bound aren't hidden by it
+ */
+template <bool DepthTest>
+void RasterizeLine(Vec3i a, Vec3i b, const TGAColor& color, TGAImage& image, DepthBuffer* depth, int bias = 0)
+{
+    const int width = image.get_width();
+    const int bytespp = image.get_bytespp();
+    if (a.z == BEHIND_EYE || b.z == BEHIND_EYE || !ClipLine(a, b, ScreenRect{0, 0, width - 1, image.get_height() - 1}))
+    {
+        return;
+    }
+
+    // walk the major axis, stepping along the minor one whenever the error crosses over
+    const int dx = b.x - a.x;
+    const int dy = b.y - a.y;
+    const bool steep = std::abs(dy) > std::abs(dx);
+    const int major = steep ? std::abs(dy) : std::abs(dx);
+    const int minor = steep ? std::abs(dx) : std::abs(dy);
+    const int xstep = dx < 0 ? -1 : 1;
+    const int ystep = dy < 0 ? -width : width;
+    const int major_step = steep ? ystep : xstep;
+    const int minor_step = steep ? xstep : ystep;
+
+    int offset = a.x + a.y * width;
+    unsigned char* pixels = image.buffer();
+    const int* zbuffer = DepthTest ? depth->buffer() : nullptr;
+    float z = (float)a.z + bias;
+    const float dz = major > 0 ? (float)(b.z - a.z) / major : 0.f;
+    int error = 0;
+    for (int i = 0; i <= major; ++i)
+    {
+        if (!DepthTest || (int)z >= zbuffer[offset])
+        {
+            memcpy(pixels + (size_t)offset * bytespp, color.raw, bytespp);
+        }
+        offset += major_step;
+        z += dz;
+        error += minor * 2;
+        if (error > major)
+        {
+            offset += minor_step;
+            error -= major * 2;
+        }
+    }
+}
+
+template <class Policy>
+void DrawTriangle(Vec3i* pts, Policy& policy, DepthBuffer& depth, TGAImage& image)
+{
+    RasterizeTriangle(pts, policy, &depth, &image);
+}
+
+/**
+ * \brief DrawTriangle limited to a rectangle, for redrawing part of a frame
+ */
+template <class Policy>
+void DrawTriangle(Vec3i* pts, Policy& policy, DepthBuffer& depth, TGAImage& image, const ScreenRect& scissor)
+{
+    RasterizeTriangle(pts, policy, &depth, &image, &scissor);
+}
+
+template <class Policy>
+void DrawTriangle(Vec3i* pts, Policy& policy, TGAImage& image)
+{
+    RasterizeTriangle(pts, policy, (DepthBuffer*)nullptr, &image);
+}
+
+/**
+ * \brief Depth-only rasterization, for policies with color_write off (shadow maps, depth prepasses)
+ */
+template <class Policy>
+void DrawTriangleDepth(Vec3i* pts, Policy& policy, DepthBuffer& depth)
+{
+    RasterizeTriangle(pts, policy, &depth, (TGAImage*)nullptr);
+}
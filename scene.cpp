@@ -0,0 +1,295 @@
+﻿#include "scene.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+Scene::Scene(): optimize_meshes_(false)
+{
+}
+
+Scene::~Scene()
+{
+}
+
+Model* Scene::add_model(const std::string& path)
+{
+    auto it = paths_.find(path);
+    if (it != paths_.end())
+    {
+        return it->second;
+    }
+    std::shared_ptr<Model> model = AssetLoader::instance().take_model(path, optimize_meshes_);
+    if (!model->loaded())
+    {
+        return nullptr;
+    }
+    models_.push_back(model);
+    models_.back()->build_bvh();
+    paths_[path] = models_.back().get();
+    return models_.back().get();
+}
+
+void Scene::set_optimize_meshes(bool optimize)
+{
+    optimize_meshes_ = optimize;
+}
+
+bool Scene::optimize_meshes()
+{
+    return optimize_meshes_;
+}
+
+int Scene::add_instance(Model* model, const Matrix& transform, float opacity)
+{
+    instances_.push_back(Instance{model, transform, opacity});
+    return (int)instances_.size() - 1;
+}
+
+void Scene::prefetch(const std::string& path, bool optimize)
+{
+    const std::string scene_ext = ".scene";
+    if (path.size() <= scene_ext.size() || path.compare(path.size() - scene_ext.size(), scene_ext.size(), scene_ext))
+    {
+        AssetLoader::instance().load_model(path, optimize);
+        return;
+    }
+
+    std::ifstream in(path.c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream iss(line);
+        std::string keyword;
+        std::string model;
+        if (iss >> keyword >> model && keyword == "model")
+        {
+            AssetLoader::instance().load_model(model, optimize);
+        }
+    }
+}
+
+bool Scene::load(const char* filename)
+{
+    std::ifstream in(filename);
+    if (in.fail())
+    {
+        std::cerr << "can't open scene " << filename << "\n";
+        return false;
+    }
+    // all models load in the background at once, add_model below only waits for them
+    prefetch(filename, optimize_meshes_);
+
+    std::vector<Model*> models;
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line))
+    {
+        ++lineno;
+        std::istringstream iss(line);
+        std::string keyword;
+        if (!(iss >> keyword) || keyword[0] == '#')
+        {
+            continue;
+        }
+        if (keyword == "model")
+        {
+            std::string path;
+            iss >> path;
+            models.push_back(add_model(path));
+        }
+        else if (keyword == "instance")
+        {
+            int idx;
+            Vec3f t;
+            Vec3f r;
+            float s = 1.f;
+            iss >> idx >> t.x >> t.y >> t.z >> r.x >> r.y >> r.z >> s;
+            if (iss.fail() || idx < 0 || idx >= (int)models.size() || !models[idx])
+            {
+                std::cerr << filename << ":" << lineno << ": bad instance\n";
+                continue;
+            }
+            float opacity;
+            if (!(iss >> opacity))
+            {
+                opacity = 1.f;
+            }
+            const float deg = 3.14159265358979f / 180.f;
+            add_instance(models[idx], translation(t) * rotation(r * deg) * scaling(s), opacity);
+        }
+    }
+    std::cerr << "# scene " << models_.size() << " models " << instances_.size() << " instances\n";
+    return true;
+}
+
+void Scene::clear()
+{
+    instances_.clear();
+    paths_.clear();
+    models_.clear();
+}
+
+int Scene::nmodels()
+{
+    return (int)models_.size();
+}
+
+Model* Scene::model(int idx)
+{
+    return models_[idx].get();
+}
+
+int Scene::ninstances()
+{
+    return (int)instances_.size();
+}
+
+Instance& Scene::instance(int idx)
+{
+    return instances_[idx];
+}
+
+bool Scene::pick(const Matrix& viewproj, int x, int y, PickResult& result)
+{
+    result.instance = -1;
+    result.depth = -std::numeric_limits<float>::max();
+    for (int i = 0; i < (int)instances_.size(); ++i)
+    {
+        Instance& instance = instances_[i];
+        BVH* bvh = instance.model->bvh();
+        if (!bvh)
+        {
+            continue;
+        }
+
+        // Pixels are sampled at integer positions like the rasterizer does
+        Matrix m = viewproj * instance.transform;
+        Vec3f orig;
+        Vec3f dir;
+        screen_ray(m, (float)x, (float)y, orig, dir);
+
+        RayHit hit;
+        if (!bvh->intersect(*instance.model, orig, dir, hit))
+        {
+            continue;
+        }
+        float depth = m2v(m * v2m(orig + dir * hit.t)).z;
+        if (depth > result.depth)
+        {
+            result.instance = i;
+            result.face = hit.face;
+            result.bar = hit.bar;
+            result.depth = depth;
+            result.uv = instance.model->uv(hit.face, 0) * hit.bar.x + instance.model->uv(hit.face, 1) * hit.bar.y +
+                instance.model->uv(hit.face, 2) * hit.bar.z;
+        }
+    }
+    return result.instance >= 0;
+}
+
+void Scene::bounds(Vec3f& lo, Vec3f& hi)
+{
+    lo = Vec3f(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(),
+               std::numeric_limits<float>::max());
+    hi = lo * -1;
+    for (Instance& instance : instances_)
+    {
+        Vec3f mlo = instance.model->bbox_min();
+        Vec3f mhi = instance.model->bbox_max();
+        for (int i = 0; i < 8; ++i)
+        {
+            Vec3f corner(i & 1 ? mhi.x : mlo.x, i & 2 ? mhi.y : mlo.y, i & 4 ? mhi.z : mlo.z);
+            Vec3f w = m2v(instance.transform * v2m(corner));
+            lo = Vec3f(std::min(lo.x, w.x), std::min(lo.y, w.y), std::min(lo.z, w.z));
+            hi = Vec3f(std::max(hi.x, w.x), std::max(hi.y, w.y), std::max(hi.z, w.z));
+        }
+    }
+    if (instances_.empty())
+    {
+        lo = hi = Vec3f();
+    }
+}
+
+std::vector<Instance*> Scene::visible(const Matrix& viewproj, int width, int height)
+{
+    std::vector<Instance*> result;
+    result.reserve(instances_.size());
+    for (Instance& instance : instances_)
+    {
+        Matrix m = viewproj * instance.transform;
+        Vec3f lo = instance.model->bbox_min();
+        Vec3f hi = instance.model->bbox_max();
+
+        // Project the 8 corners, the instance is hidden if they are all off the same side of the screen
+        int left = 0, right = 0, below = 0, above = 0;
+        bool behind = false;
+        for (int i = 0; i < 8; ++i)
+        {
+            Vec3f corner(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+            Matrix p = m * v2m(corner);
+            if (p[3][0] <= 0.f)
+            {
+                behind = true;
+                break;
+            }
+            Vec3f s = m2v(p);
+            left += s.x < 0;
+            right += s.x >= width;
+            below += s.y < 0;
+            above += s.y >= height;
+        }
+        if (behind || (left < 8 && right < 8 && below < 8 && above < 8))
+        {
+            result.push_back(&instance);
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), [](const Instance* a, const Instance* b)
+    {
+        return a->model < b->model;
+    });
+    return result;
+}
+
+Model* SelectLod(Model* model, const Matrix& transform)
+{
+    if (model->nlods() == 1)
+    {
+        return model;
+    }
+
+    Matrix m = transform;
+    Vec3f lo = model->bbox_min();
+    Vec3f hi = model->bbox_max();
+    Vec3f screenmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), 0.f);
+    Vec3f screenmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), 0.f);
+    for (int i = 0; i < 8; ++i)
+    {
+        Vec3f corner(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+        Matrix p = m * v2m(corner);
+        if (p[3][0] <= 0.f)
+        {
+            return model;
+        }
+        Vec3f s = m2v(p);
+        screenmin = Vec3f(std::min(screenmin.x, s.x), std::min(screenmin.y, s.y), 0.f);
+        screenmax = Vec3f(std::max(screenmax.x, s.x), std::max(screenmax.y, s.y), 0.f);
+    }
+    const float faces = (screenmax.x - screenmin.x) * (screenmax.y - screenmin.y) / LOD_PIXELS_PER_FACE;
+
+    Model* result = model;
+    for (int level = 1; level < model->nlods() && model->lod(level)->nfaces() >= faces; ++level)
+    {
+        result = model->lod(level);
+    }
+    return result;
+}
+
+Vec3f ObjectLightDir(const Matrix& transform, Vec3f light_dir)
+{
+    // normals go to world space through the inverse transpose N of the linear part, and (N n) . l = n . (N^T l)
+    return (Matrix3(transform).inverse() * light_dir).normalize();
+}
@@ -0,0 +1,318 @@
+﻿#pragma once
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "assetloader.h"
+#include "framebuffer.h"
+#include "geometry.h"
+#include "model.h"
+#include "oit.h"
+#include "shader.h"
+#include "tgaimage.h"
+
+/**
+ * \brief One placement of a shared Model
+ */
+struct Instance
+{
+    Model* model;
+    // object space to world space
+    Matrix transform;
+    // below 1 the instance is drawn transparent, after the opaque ones
+    float opacity;
+};
+
+struct PickResult
+{
+    int instance;
+    int face;
+    // barycentric coordinates of the hit on the face
+    Vec3f bar;
+    // texture coordinates at the hit
+    Vec2f uv;
+    // screen space depth of the hit, bigger is closer
+    float depth;
+};
+
+/**
+ * \brief Models and the instances placing them. Each model file is loaded once and every instance of it
+ * shares the mesh, and through TextureCache the textures.
+ */
+class Scene
+{
+public:
+    Scene();
+    ~Scene();
+
+    /**
+     * \brief Load a model, or return the one already loaded from the same path.
+     * Models prefetched through the AssetLoader are taken over from it once loaded.
+     * The model's BVH is built right away for culling and picking.
+     * \return null when the file couldn't be loaded
+     */
+    Model* add_model(const std::string& path);
+
+    /**
+     * \brief Load models added from now on with the vertex cache optimization and its binary mesh cache
+     */
+    void set_optimize_meshes(bool optimize);
+    bool optimize_meshes();
+
+    int add_instance(Model* model, const Matrix& transform, float opacity = 1.f);
+
+    /**
+     * \brief Closest instance face under screen pixel (x, y), found through the models' BVHs
+     */
+    bool pick(const Matrix& viewproj, int x, int y, PickResult& result);
+
+    /**
+     * \brief Read a scene description, one entry per line, '#' starts a comment
+     *   model <path.obj>
+     *   instance <model index> <tx ty tz> <rx ry rz in degrees> <uniform scale> [opacity]
+     */
+    bool load(const char* filename);
+
+    /**
+     * \brief Start loading the models of a scene file, or a single obj, in the background, e.g. the next batch
+     * item while the current one renders. A later load() or add_model() picks them up.
+     */
+    static void prefetch(const std::string& path, bool optimize = false);
+
+    // drop all instances and models
+    void clear();
+
+    int nmodels();
+    Model* model(int idx);
+
+    int ninstances();
+    Instance& instance(int idx);
+
+    /**
+     * \brief World space axis aligned bounds of all instances
+     */
+    void bounds(Vec3f& lo, Vec3f& hi);
+
+    /**
+     * \brief Instances whose bounding box lands on the width x height screen, grouped by model
+     * so consecutive draws reuse the same mesh and textures
+     */
+    std::vector<Instance*> visible(const Matrix& viewproj, int width, int height);
+
+private:
+    std::vector<std::shared_ptr<Model>> models_;
+    std::map<std::string, Model*> paths_;
+    std::vector<Instance> instances_;
+    bool optimize_meshes_;
+};
+
+/**
+ * \brief World light direction expressed in an instance's object space, so the shaders can keep lighting
+ * with the model's own normals. Exact for rotations and uniform scale, other transforms are off only by the
+ * length of the transformed normals.
+ */
+Vec3f ObjectLightDir(const Matrix& transform, Vec3f light_dir);
+
+/**
+ * \brief Projected bounding box area, in pixels, that one face of the chosen level of detail should cover
+ */
+const float LOD_PIXELS_PER_FACE = 4.f;
+
+/**
+ * \brief The coarsest level of detail of the model that still has a face per LOD_PIXELS_PER_FACE pixels of its
+ * projected bounding box. The model itself when it has no LODs or reaches behind the eye.
+ * \param transform Object space to screen space
+ */
+Model* SelectLod(Model* model, const Matrix& transform);
+
+/**
+ * \brief Geometry stage output for one frame: the visible instances with their level of detail, transforms and
+ * screen space vertices, everything DrawPrepared needs to rasterize the frame
+ */
+struct FrameGeometry
+{
+    struct Item
+    {
+        const Instance* instance;
+        Model* model;
+        // object space to world space, and to screen space
+        Matrix world;
+        Matrix transform;
+        // light in object space, as passed to the shader
+        Vec3f light_dir;
+        // faces left by culling, the only ones drawn, and the vertices they use
+        std::vector<int> faces;
+        std::vector<int> verts;
+        // indexed like the model's vertices and normals, only the entries of verts and their normals are set;
+        // the other screen entries are (0, 0, BEHIND_EYE)
+        std::vector<Vec3i> screen;
+        std::vector<float> intensity;
+        // screen space bounds of the vertices
+        ScreenRect bounds;
+    };
+
+    // items beyond count are kept to reuse their storage
+    std::vector<Item> items;
+    int count;
+};
+
+/**
+ * \brief Geometry stage: cull the instances, pick their levels of detail, cull their faces with CullFaces and run
+ * the vertex stage over the faces left
+ * \param keep_back Keep the back facing clusters of closed meshes, for wireframes that show every edge
+ */
+template <class Shader>
+void PrepareScene(Scene& scene, const Matrix& viewproj, Vec3f light_dir, int width, int height,
+                  FrameGeometry& geometry, bool keep_back = false)
+{
+    std::vector<Instance*> visible = scene.visible(viewproj, width, height);
+    if (geometry.items.size() < visible.size())
+    {
+        geometry.items.resize(visible.size());
+    }
+    geometry.count = (int)visible.size();
+    for (int i = 0; i < geometry.count; ++i)
+    {
+        FrameGeometry::Item& item = geometry.items[i];
+        item.world = visible[i]->transform;
+        item.transform = viewproj * item.world;
+        item.model = SelectLod(visible[i]->model, item.transform);
+        item.light_dir = ObjectLightDir(item.world, light_dir);
+        // transparent instances show their far side, DrawPrepared draws them without depth writes
+        const bool opaque = Shader::depth_write && visible[i]->opacity >= 1.f && !keep_back;
+        CullFaces(*item.model, item.transform, width, height, Shader::cull_back, opaque, item.faces);
+        // the shader normalizes its copy of the light the same way
+        Vec3f light = item.light_dir;
+        TransformVertices(*item.model, item.transform, light.normalize(), Shader::vertex_lighting, item.faces,
+                          item.screen, item.intensity, item.verts);
+        item.instance = visible[i];
+        item.bounds = ScreenRect{std::numeric_limits<int>::max(), std::numeric_limits<int>::max(),
+                                 std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+        for (int v : item.verts)
+        {
+            const Vec3i& p = item.screen[v];
+            if (p.z == BEHIND_EYE)
+            {
+                continue;
+            }
+            item.bounds.x0 = std::min(item.bounds.x0, p.x);
+            item.bounds.y0 = std::min(item.bounds.y0, p.y);
+            item.bounds.x1 = std::max(item.bounds.x1, p.x);
+            item.bounds.y1 = std::max(item.bounds.y1, p.y);
+        }
+    }
+}
+
+/**
+ * \brief Draw one model with shader, through the Transparent wrapper when opacity is below 1
+ */
+template <class Shader>
+void DrawOpacity(Model& model, Shader& shader, float opacity, DepthBuffer& depth, TGAImage& image,
+                 FragmentBuffer* fragments, const ScreenRect* scissor)
+{
+    if (opacity >= 1.f)
+    {
+        DrawModel(model, shader, depth, image, scissor);
+    }
+    else if (fragments)
+    {
+        Transparent<Shader, true> transparent(shader, opacity, fragments);
+        DrawModel(model, transparent, depth, image, scissor);
+    }
+    else
+    {
+        Transparent<Shader, false> transparent(shader, opacity, nullptr);
+        DrawModel(model, transparent, depth, image, scissor);
+    }
+}
+
+/**
+ * \brief Raster stage for a frame prepared by PrepareScene. The opaque instances are drawn first, then the
+ * transparent ones, which only test against the opaque depth.
+ * \param shadow Optional shadow map, its transform maps world space to shadow map screen space
+ * \param scissor Only redraw this part of the frame, items entirely outside of it are skipped
+ * \param fragments Collects the transparent fragments for FragmentBuffer::resolve(), null to blend them in drawing
+ * order instead
+ */
+template <class Shader>
+void DrawPrepared(FrameGeometry& geometry, DepthBuffer& depth, TGAImage& image, ShadowMap* shadow = nullptr,
+                  const ScreenRect* scissor = nullptr, FragmentBuffer* fragments = nullptr)
+{
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const bool transparent_pass = pass == 1;
+        for (int i = 0; i < geometry.count; ++i)
+        {
+            FrameGeometry::Item& item = geometry.items[i];
+            const float opacity = item.instance->opacity;
+            if ((opacity < 1.f) != transparent_pass)
+            {
+                continue;
+            }
+            if (scissor && (item.bounds.x1 < scissor->x0 || item.bounds.x0 > scissor->x1 ||
+                            item.bounds.y1 < scissor->y0 || item.bounds.y0 > scissor->y1))
+            {
+                continue;
+            }
+            Shader shader(item.model, item.transform, item.light_dir);
+            shader.screen = item.screen.data();
+            shader.intensity = Shader::vertex_lighting ? item.intensity.data() : nullptr;
+            shader.faces = &item.faces;
+            if (shadow)
+            {
+                Shadowed<Shader> shadowed(shader, shadow, shadow->transform * item.world);
+                DrawOpacity(*item.model, shadowed, opacity, depth, image, fragments, scissor);
+            }
+            else
+            {
+                DrawOpacity(*item.model, shader, opacity, depth, image, fragments, scissor);
+            }
+        }
+    }
+}
+
+/**
+ * \brief Depth-only pass over a frame prepared by PrepareScene, e.g. before hidden line wireframes
+ */
+inline void DrawPreparedDepth(FrameGeometry& geometry, DepthBuffer& depth)
+{
+    for (int i = 0; i < geometry.count; ++i)
+    {
+        FrameGeometry::Item& item = geometry.items[i];
+        DepthShader shader(item.model, item.transform);
+        shader.screen = item.screen.data();
+        shader.faces = &item.faces;
+        DrawModelDepth(*item.model, shader, depth);
+    }
+}
+
+/**
+ * \brief Wireframe of a frame prepared by PrepareScene, reusing its screen space vertices. Edges that only culled
+ * faces share are left out.
+ * \param depth Hide the edges behind it, null to draw them all
+ */
+inline void DrawPreparedWireframe(FrameGeometry& geometry, const TGAColor& color, TGAImage& image,
+                                  DepthBuffer* depth = nullptr)
+{
+    for (int i = 0; i < geometry.count; ++i)
+    {
+        FrameGeometry::Item& item = geometry.items[i];
+        DrawWireframe(*item.model, item.screen.data(), color, image, depth);
+    }
+}
+
+/**
+ * \brief Depth-only pass over the scene, e.g. to fill a shadow map
+ */
+inline void DrawSceneDepth(Scene& scene, const Matrix& viewproj, DepthBuffer& depth)
+{
+    for (Instance* instance : scene.visible(viewproj, depth.get_width(), depth.get_height()))
+    {
+        Matrix transform = viewproj * instance->transform;
+        Model* model = SelectLod(instance->model, transform);
+        DepthShader shader(model, transform);
+        DrawModelDepth(*model, shader, depth);
+    }
+}
@@ -0,0 +1,667 @@
+﻿#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "framebuffer.h"
+#include "geometry.h"
+#include "model.h"
+#include "oit.h"
+#include "rasterizer.h"
+#include "threadpool.h"
+#include "tgaimage.h"
+
+/**
+ * \brief Programmable pipeline stages, bound statically through CRTP.
+ * A shader derives from IShader<Itself> and provides
+ *   Vec3i vertex(int iface, int nthvert)          - returns screen coordinates and stores the varyings of that corner
+ *   bool fragment(const Vec3f& bar, TGAColor& c)  - shades one fragment from barycentric coordinates
+ * DrawModel and DrawTriangle are templates on the concrete shader type, so both calls inline into the loops
+ * and no virtual dispatch happens per vertex or per pixel.
+ */
+template <class Derived>
+struct IShader
+{
+    // DrawTriangle reads these as compile time constants, a shader can hide them to turn features off
+    static const bool depth_test = true;
+    static const bool depth_write = true;
+    static const bool blend = false;
+    static const bool transparent = false;
+    static const bool color_write = true;
+    static const bool cull_back = false;
+    // the shader lights vertex normals with vertex_intensity(), so the vertex stage precomputes them
+    static const bool vertex_lighting = false;
+
+    IShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : model(model),
+          transform(transform),
+          fused(transform),
+          light_dir(light_dir.normalize()),
+          ambient(0.2f),
+          screen(nullptr),
+          intensity(nullptr),
+          faces(nullptr)
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        return static_cast<Derived*>(this)->vertex(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        return static_cast<Derived*>(this)->fragment(bar, color);
+    }
+
+    Model* model;
+    // object space to screen space, viewport * projection * modelview
+    Matrix transform;
+    // the same as a fixed size matrix for the vertex stage
+    Matrix4 fused;
+    // direction the light travels in, normalized
+    Vec3f light_dir;
+    // lower bound of the diffuse term
+    float ambient;
+    // Results of the parallel vertex stage in ProcessFaces, indexed like the model's vertices and normals.
+    // Null when it didn't run, the corners are then transformed and lit one at a time.
+    const Vec3i* screen;
+    const float* intensity;
+    // Faces left by the geometry stage's culling, drawn in this order. Null when it didn't run, ProcessFaces then
+    // culls on its own.
+    const std::vector<int>* faces;
+
+protected:
+    Vec3i project(Vec3f v)
+    {
+        return fused.project_screen(v);
+    }
+
+    Vec3i project(int iface, int nthvert)
+    {
+        return screen ? screen[model->vert_index(iface, nthvert)] : project(model->vert(iface, nthvert));
+    }
+
+    // vertex normal dotted with the light
+    float vertex_intensity(int iface, int nthvert)
+    {
+        return intensity ? intensity[model->norm_index(iface, nthvert)]
+                         : model->norm(iface, nthvert) * (light_dir * -1);
+    }
+
+    float diffuse_intensity(Vec3f n)
+    {
+        return std::max(ambient, n * (light_dir * -1));
+    }
+
+    // Phong reflection towards a viewer looking down -z, exponent from the model's specular map
+    float specular_intensity(Vec3f n, Vec2f uv)
+    {
+        Vec3f l = light_dir * -1;
+        Vec3f r = (n * ((n * l) * 2.f) - l).normalize();
+        return std::pow(std::max(r.z, 0.f), model->specular(uv));
+    }
+
+    static TGAColor modulate(const TGAColor& c, float intensity)
+    {
+        return TGAColor((unsigned char)std::min(255.f, c.r * intensity),
+                        (unsigned char)std::min(255.f, c.g * intensity),
+                        (unsigned char)std::min(255.f, c.b * intensity), c.a);
+    }
+};
+
+/**
+ * \brief Diffuse texture, lighting evaluated per vertex and interpolated
+ */
+struct GouraudShader : IShader<GouraudShader>
+{
+    static const bool vertex_lighting = true;
+
+    GouraudShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : IShader<GouraudShader>(model, transform, light_dir)
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_uv[nthvert] = model->uv(iface, nthvert);
+        varying_intensity[nthvert] = vertex_intensity(iface, nthvert);
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        Vec2f uv = varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z;
+        float intensity = varying_intensity[0] * bar.x + varying_intensity[1] * bar.y + varying_intensity[2] * bar.z;
+        color = modulate(model->diffuse(uv), std::max(ambient, intensity));
+        return true;
+    }
+
+    Vec2f varying_uv[3];
+    float varying_intensity[3];
+};
+
+/**
+ * \brief Diffuse texture, vertex normals interpolated and lit per pixel
+ */
+struct PhongShader : IShader<PhongShader>
+{
+    PhongShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : IShader<PhongShader>(model, transform, light_dir)
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_uv[nthvert] = model->uv(iface, nthvert);
+        varying_norm[nthvert] = model->norm(iface, nthvert);
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        Vec2f uv = varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z;
+        Vec3f n = varying_norm[0] * bar.x + varying_norm[1] * bar.y + varying_norm[2] * bar.z;
+        color = modulate(model->diffuse(uv), diffuse_intensity(n.normalize()));
+        return true;
+    }
+
+    Vec2f varying_uv[3];
+    Vec3f varying_norm[3];
+};
+
+/**
+ * \brief Diffuse texture lit per pixel with normals read from the model's object space normal map,
+ * plus a specular term when the model has a specular map
+ */
+struct NormalMappedShader : IShader<NormalMappedShader>
+{
+    NormalMappedShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : IShader<NormalMappedShader>(model, transform, light_dir),
+          specular(model->has_specularmap())
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_uv[nthvert] = model->uv(iface, nthvert);
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        Vec2f uv = varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z;
+        Vec3f n = model->normal(uv).normalize();
+        float intensity = diffuse_intensity(n);
+        if (specular)
+        {
+            intensity += .6f * specular_intensity(n, uv);
+        }
+        color = modulate(model->diffuse(uv), intensity);
+        return true;
+    }
+
+    Vec2f varying_uv[3];
+    bool specular;
+};
+
+/**
+ * \brief Like NormalMappedShader but for tangent space normal maps. The tangent frame is built once per triangle
+ * in the vertex stage from the positions and uvs, then re-orthogonalized against the interpolated vertex normal.
+ */
+struct TangentNormalShader : IShader<TangentNormalShader>
+{
+    TangentNormalShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : IShader<TangentNormalShader>(model, transform, light_dir),
+          specular(model->has_specularmap())
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_uv[nthvert] = model->uv(iface, nthvert);
+        varying_norm[nthvert] = model->norm(iface, nthvert);
+        varying_pos[nthvert] = model->vert(iface, nthvert);
+        if (nthvert == 2)
+        {
+            Vec3f e1 = varying_pos[1] - varying_pos[0];
+            Vec3f e2 = varying_pos[2] - varying_pos[0];
+            Vec2f duv1 = varying_uv[1] - varying_uv[0];
+            Vec2f duv2 = varying_uv[2] - varying_uv[0];
+            float det = duv1.u * duv2.v - duv2.u * duv1.v;
+            float r = std::fabs(det) > 1e-12f ? 1.f / det : 0.f;
+            tangent = (e1 * duv2.v - e2 * duv1.v) * r;
+            bitangent = (e2 * duv1.u - e1 * duv2.u) * r;
+        }
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        Vec2f uv = varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z;
+        Vec3f n = (varying_norm[0] * bar.x + varying_norm[1] * bar.y + varying_norm[2] * bar.z).normalize();
+        Vec3f t = tangent - n * (n * tangent);
+        float tlength = t.norm();
+        if (tlength > 1e-6f)
+        {
+            t = t * (1.f / tlength);
+            Vec3f b = n ^ t;
+            if (b * bitangent < 0)
+            {
+                b = b * -1;
+            }
+            Vec3f tn = model->normal_tangent(uv);
+            n = (t * tn.x + b * tn.y + n * tn.z).normalize();
+        }
+        float intensity = diffuse_intensity(n);
+        if (specular)
+        {
+            intensity += .6f * specular_intensity(n, uv);
+        }
+        color = modulate(model->diffuse(uv), intensity);
+        return true;
+    }
+
+    Vec2f varying_uv[3];
+    Vec3f varying_norm[3];
+    Vec3f varying_pos[3];
+    Vec3f tangent;
+    Vec3f bitangent;
+    bool specular;
+};
+
+/**
+ * \brief Diffuse texture only, no lighting
+ */
+struct UnlitShader : IShader<UnlitShader>
+{
+    UnlitShader(Model* model, const Matrix& transform, Vec3f light_dir)
+        : IShader<UnlitShader>(model, transform, light_dir)
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_uv[nthvert] = model->uv(iface, nthvert);
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        color = model->diffuse(varying_uv[0] * bar.x + varying_uv[1] * bar.y + varying_uv[2] * bar.z);
+        return true;
+    }
+
+    Vec2f varying_uv[3];
+};
+
+/**
+ * \brief Depth-only pass for shadow maps and depth prepasses.
+ * Never writes color or fetches textures, and culls back faces since they are hidden behind the front ones anyway.
+ */
+struct DepthShader : IShader<DepthShader>
+{
+    static const bool color_write = false;
+    static const bool cull_back = true;
+
+    DepthShader(Model* model, const Matrix& transform)
+        : IShader<DepthShader>(model, transform, Vec3f(0, 0, -1))
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        return project(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f&, TGAColor&)
+    {
+        return false;
+    }
+};
+
+/**
+ * \brief Depth seen from the light, filled by a DepthShader pass and sampled by Shadowed shaders
+ */
+struct ShadowMap
+{
+    ShadowMap(int w, int h)
+        : depth(w, h),
+          transform(Matrix::identity(4)),
+          bias(10),
+          pcf(false)
+    {
+    }
+
+    /**
+     * \param p Position in shadow map screen space
+     * \return 1 when the light reaches p, 0 when it's occluded, in between on PCF edges
+     */
+    float lit(const Vec3f& p)
+    {
+        const int x = (int)(p.x + .5f);
+        const int y = (int)(p.y + .5f);
+        const int z = (int)p.z + bias;
+        if (!pcf)
+        {
+            return depth.get(x, y) > z ? 0.f : 1.f;
+        }
+
+        // 3x3 percentage closer filtering
+        int visible = 0;
+        for (int j = -1; j <= 1; ++j)
+        {
+            for (int i = -1; i <= 1; ++i)
+            {
+                visible += depth.get(x + i, y + j) > z ? 0 : 1;
+            }
+        }
+        return visible / 9.f;
+    }
+
+    DepthBuffer depth;
+    // world space to shadow map screen space
+    Matrix transform;
+    // depth units a fragment may lie behind the stored depth and still count as lit, hides self shadowing acne
+    int bias;
+    bool pcf;
+};
+
+/**
+ * \brief Adds shadowing to any shader: the vertex stage also projects into the shadow map,
+ * and the base shader's color is darkened where the light is occluded.
+ */
+template <class Base>
+struct Shadowed : Base
+{
+    /**
+     * \param object_to_shadow Object space to shadow map screen space, shadow->transform times the model matrix
+     */
+    Shadowed(const Base& base, ShadowMap* shadow, const Matrix& object_to_shadow)
+        : Base(base),
+          shadow(shadow),
+          object_to_shadow(object_to_shadow)
+    {
+    }
+
+    Vec3i vertex(int iface, int nthvert)
+    {
+        varying_shadow[nthvert] = object_to_shadow.project(this->model->vert(iface, nthvert));
+        return Base::vertex(iface, nthvert);
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        if (!Base::fragment(bar, color))
+        {
+            return false;
+        }
+        Vec3f p = varying_shadow[0] * bar.x + varying_shadow[1] * bar.y + varying_shadow[2] * bar.z;
+        color = Base::modulate(color, .3f + .7f * shadow->lit(p));
+        return true;
+    }
+
+    ShadowMap* shadow;
+    Matrix4 object_to_shadow;
+    Vec3f varying_shadow[3];
+};
+
+/**
+ * \brief Draws any shader with a constant opacity. The fragments are depth tested against the opaque geometry
+ * drawn before but don't write depth, so transparent surfaces never hide each other.
+ * \tparam OIT Push the fragments to a FragmentBuffer that resolve() blends back to front, otherwise blend them
+ * straight into the image in drawing order
+ */
+template <class Base, bool OIT>
+struct Transparent : Base
+{
+    static const bool depth_write = false;
+    static const bool blend = !OIT;
+    static const bool transparent = OIT;
+
+    /**
+     * \param fragments Where the fragments go with OIT, unused otherwise
+     */
+    Transparent(const Base& base, float opacity, FragmentBuffer* fragments)
+        : Base(base),
+          alpha((unsigned char)(std::min(std::max(opacity, 0.f), 1.f) * 255.f + .5f)),
+          fragments(fragments)
+    {
+    }
+
+    bool fragment(const Vec3f& bar, TGAColor& color)
+    {
+        if (!Base::fragment(bar, color))
+        {
+            return false;
+        }
+        color.a = alpha;
+        return true;
+    }
+
+    unsigned char alpha;
+    FragmentBuffer* fragments;
+};
+
+/**
+ * \brief Models with fewer vertices are transformed a corner at a time, the pool's overhead would outweigh the gain
+ */
+const int PARALLEL_VERTEX_MIN = 16384;
+// vertices per ThreadPool task
+const int PARALLEL_VERTEX_GRAIN = 4096;
+
+/**
+ * \brief Transform the vertices the given faces use to screen space, and light their normals when lighting is set,
+ * in parallel over contiguous ranges on the shared ThreadPool. The vertices of culled faces cost nothing: their
+ * screen entries are left at (0, 0, BEHIND_EYE), which the rasterizer drops like points behind the eye, and their
+ * intensities are left unset.
+ * \param light_dir Normalized direction the light travels in
+ * \param verts Filled with the vertices the faces use, each once
+ */
+inline void TransformVertices(Model& model, const Matrix& transform, Vec3f light_dir, bool lighting,
+                              const std::vector<int>& faces, std::vector<Vec3i>& screen,
+                              std::vector<float>& intensity, std::vector<int>& verts)
+{
+    static thread_local std::vector<unsigned char> seen;
+    static thread_local std::vector<int> norms;
+    verts.clear();
+    seen.assign(model.nverts(), 0);
+    for (int i : faces)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            const int v = model.vert_index(i, j);
+            if (!seen[v])
+            {
+                seen[v] = 1;
+                verts.push_back(v);
+            }
+        }
+    }
+
+    ThreadPool& pool = ThreadPool::instance();
+    const Matrix4 fused(transform);
+    screen.assign(model.nverts(), Vec3i(0, 0, BEHIND_EYE));
+    pool.parallel_for(0, (int)verts.size(), PARALLEL_VERTEX_GRAIN, [&](int begin, int end)
+    {
+        for (int k = begin; k < end; ++k)
+        {
+            screen[verts[k]] = fused.project_screen(model.vert(verts[k]));
+        }
+    });
+
+    if (lighting)
+    {
+        norms.clear();
+        seen.assign(model.nnorms(), 0);
+        for (int i : faces)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                const int n = model.norm_index(i, j);
+                if (!seen[n])
+                {
+                    seen[n] = 1;
+                    norms.push_back(n);
+                }
+            }
+        }
+        const Vec3f l = light_dir * -1;
+        intensity.resize(model.nnorms());
+        pool.parallel_for(0, (int)norms.size(), PARALLEL_VERTEX_GRAIN, [&](int begin, int end)
+        {
+            for (int k = begin; k < end; ++k)
+            {
+                intensity[norms[k]] = model.norm(norms[k]) * l;
+            }
+        });
+    }
+}
+
+/**
+ * \brief Whether TransformVertices(model, shader, faces) transforms the model up front into its per-thread arrays
+ */
+inline bool ParallelVertices(Model& model)
+{
+    return model.nverts() >= PARALLEL_VERTEX_MIN && ThreadPool::instance().nthreads() > 1;
+}
+
+/**
+ * \brief TransformVertices for a shader about to draw the faces of the model. Results go to the shader's screen
+ * and intensity arrays, which stay valid until the next call on this thread.
+ * \return false when the model is too small to be worth it, the shader then works per corner
+ */
+template <class Shader>
+bool TransformVertices(Model& model, Shader& shader, const std::vector<int>& faces)
+{
+    if (!ParallelVertices(model))
+    {
+        return false;
+    }
+
+    static thread_local std::vector<Vec3i> screen;
+    static thread_local std::vector<float> intensity;
+    static thread_local std::vector<int> verts;
+    TransformVertices(model, shader.transform, shader.light_dir, Shader::vertex_lighting, faces, screen, intensity,
+                      verts);
+    shader.screen = screen.data();
+    shader.intensity = Shader::vertex_lighting ? intensity.data() : nullptr;
+    return true;
+}
+
+/**
+ * \brief The faces of the model that may land on the width x height screen, in drawing order.
+ * With clusters, whole clusters that are off screen or back facing are left out; back facing ones only when
+ * cull_back is set, or when the surface is opaque and the mesh is closed so front faces hide them.
+ * Otherwise with a BVH, leaves that fall outside the screen are left out. Without either, every face.
+ * \param transform Object space to screen space
+ */
+inline void CullFaces(Model& model, const Matrix& transform, int width, int height, bool cull_back, bool opaque,
+                      std::vector<int>& faces)
+{
+    faces.clear();
+    ClusterSet* clusters = model.clusters();
+    BVH* bvh = model.bvh();
+    if (clusters)
+    {
+        clusters->cull(transform, width, height, cull_back || (opaque && clusters->closed()), faces);
+    }
+    else if (bvh)
+    {
+        bvh->cull(transform, width, height, faces);
+    }
+    else
+    {
+        faces.resize(model.nfaces());
+        for (int i = 0; i < model.nfaces(); ++i)
+        {
+            faces[i] = i;
+        }
+    }
+}
+
+/**
+ * \brief Cull the model's faces with CullFaces, run the vertex stage over the ones left, so culled faces cost no
+ * vertex work, and hand each screen space triangle to draw
+ */
+template <class Shader, class Draw>
+void ProcessFaces(Model& model, Shader& shader, int width, int height, Draw draw)
+{
+    // the geometry stage of a FramePipeline may have culled and transformed them already
+    const std::vector<int>* faces = shader.faces;
+    if (!faces)
+    {
+        static thread_local std::vector<int> culled;
+        // shaders that don't write depth, like Transparent, show the far side of closed meshes
+        CullFaces(model, shader.transform, width, height, Shader::cull_back, Shader::depth_write, culled);
+        faces = &culled;
+    }
+    if (!shader.screen)
+    {
+        TransformVertices(model, shader, *faces);
+    }
+
+    Vec3i screen_coords[3];
+    for (int i : *faces)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            screen_coords[j] = shader.vertex(i, j);
+        }
+        draw(screen_coords);
+    }
+}
+
+/**
+ * \brief Run every face of the model through the shader's vertex stage and rasterize it
+ * \param scissor Limit drawing to this rectangle, null for the whole image
+ */
+template <class Shader>
+void DrawModel(Model& model, Shader& shader, DepthBuffer& depth, TGAImage& image,
+               const ScreenRect* scissor = nullptr)
+{
+    ProcessFaces(model, shader, image.get_width(), image.get_height(), [&](Vec3i* screen_coords)
+    {
+        RasterizeTriangle(screen_coords, shader, &depth, &image, scissor);
+    });
+}
+
+// depth units an edge is pulled towards the viewer, so the faces it bounds don't hide it
+const int WIREFRAME_DEPTH_BIAS = 4;
+
+/**
+ * \brief Draw each edge of the model once, see Model::build_edges, which runs on the first call
+ * \param screen Screen coordinates of the model's vertices
+ * \param depth Hide edges behind it, the faces drawn before for an overlay or a depth prepass for hidden lines.
+ * Null draws every edge.
+ */
+inline void DrawWireframe(Model& model, const Vec3i* screen, const TGAColor& color, TGAImage& image,
+                          DepthBuffer* depth = nullptr)
+{
+    if (model.edges().empty())
+    {
+        model.build_edges();
+    }
+    for (const Vec2i& edge : model.edges())
+    {
+        if (depth)
+        {
+            RasterizeLine<true>(screen[edge.x], screen[edge.y], color, image, depth, WIREFRAME_DEPTH_BIAS);
+        }
+        else
+        {
+            RasterizeLine<false>(screen[edge.x], screen[edge.y], color, image, nullptr);
+        }
+    }
+}
+
+/**
+ * \brief DrawModel for depth-only shaders
+ */
+template <class Shader>
+void DrawModelDepth(Model& model, Shader& shader, DepthBuffer& depth)
+{
+    ProcessFaces(model, shader, depth.get_width(), depth.get_height(), [&](Vec3i* screen_coords)
+    {
+        DrawTriangleDepth(screen_coords, shader, depth);
+    });
+}
@@ -0,0 +1,342 @@
+﻿#include "simplify.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace
+{
+    // faces whose normal turns by more than ~80 degrees make a collapse invalid
+    const float SIMPLIFY_MAX_FLIP = 0.2f;
+
+    /**
+     * \brief Symmetric 4x4 error quadric, upper triangle
+     */
+    struct Quadric
+    {
+        double a[10];
+
+        Quadric()
+        {
+            std::fill(a, a + 10, 0.0);
+        }
+
+        // plane n.p + d = 0
+        void add_plane(Vec3f n, float d, float weight)
+        {
+            const double p[4] = {n.x, n.y, n.z, d};
+            int k = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                for (int j = i; j < 4; ++j)
+                {
+                    a[k++] += weight * p[i] * p[j];
+                }
+            }
+        }
+
+        void add(const Quadric& q)
+        {
+            for (int i = 0; i < 10; ++i)
+            {
+                a[i] += q.a[i];
+            }
+        }
+
+        double error(Vec3f v) const
+        {
+            const double p[4] = {v.x, v.y, v.z, 1.0};
+            double e = 0.0;
+            int k = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                for (int j = i; j < 4; ++j)
+                {
+                    e += (i == j ? 1.0 : 2.0) * a[k++] * p[i] * p[j];
+                }
+            }
+            return e;
+        }
+    };
+
+    struct Collapse
+    {
+        double cost;
+        int from;
+        int to;
+        // versions of both vertices when queued, the entry is stale once either changed
+        int from_version;
+        int to_version;
+
+        bool operator<(const Collapse& other) const
+        {
+            return cost > other.cost;
+        }
+    };
+
+    Vec3f face_normal(const std::vector<Vec3f>& verts, int a, int b, int c)
+    {
+        return (verts[b] - verts[a]) ^ (verts[c] - verts[a]);
+    }
+}
+
+void simplify_mesh(const std::vector<Vec3f>& verts, std::vector<Vec3i>& corners, int target_faces)
+{
+    const int nverts = (int)verts.size();
+    const int ntris = (int)corners.size() / 3;
+
+    std::vector<std::vector<int>> adjacency(nverts);
+    for (int t = 0; t < ntris; ++t)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            adjacency[corners[t * 3 + j].ivert].push_back(t);
+        }
+    }
+
+    // seams: a position used with more than one uv or normal
+    std::vector<char> locked(nverts, 0);
+    std::vector<int> vertuv(nverts, -1);
+    std::vector<int> vertnorm(nverts, -1);
+    for (const Vec3i& c : corners)
+    {
+        if (vertuv[c.ivert] < 0)
+        {
+            vertuv[c.ivert] = c.iuv;
+            vertnorm[c.ivert] = c.inorm;
+        }
+        else if (vertuv[c.ivert] != c.iuv || vertnorm[c.ivert] != c.inorm)
+        {
+            locked[c.ivert] = 1;
+        }
+    }
+
+    // borders and non manifold edges: every edge must be shared by exactly two faces
+    std::vector<std::pair<int, int>> edges;
+    edges.reserve(corners.size());
+    for (int t = 0; t < ntris; ++t)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            int a = corners[t * 3 + j].ivert;
+            int b = corners[t * 3 + (j + 1) % 3].ivert;
+            edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();)
+    {
+        size_t j = i;
+        while (j < edges.size() && edges[j] == edges[i])
+        {
+            ++j;
+        }
+        if (j - i != 2)
+        {
+            locked[edges[i].first] = locked[edges[i].second] = 1;
+        }
+        i = j;
+    }
+
+    // area weighted plane quadrics
+    std::vector<Quadric> quadrics(nverts);
+    for (int t = 0; t < ntris; ++t)
+    {
+        const int a = corners[t * 3].ivert;
+        Vec3f n = face_normal(verts, a, corners[t * 3 + 1].ivert, corners[t * 3 + 2].ivert);
+        float area = n.norm();
+        if (area <= 0.f)
+        {
+            continue;
+        }
+        n = n * (1.f / area);
+        for (int j = 0; j < 3; ++j)
+        {
+            quadrics[corners[t * 3 + j].ivert].add_plane(n, -(n * verts[a]), area * .5f);
+        }
+    }
+
+    std::vector<int> version(nverts, 0);
+    std::vector<char> removed(nverts, 0);
+    std::vector<char> dead(ntris, 0);
+    std::priority_queue<Collapse> heap;
+    auto push = [&](int from, int to)
+    {
+        if (locked[from])
+        {
+            return;
+        }
+        Quadric q = quadrics[from];
+        q.add(quadrics[to]);
+        heap.push(Collapse{q.error(verts[to]), from, to, version[from], version[to]});
+    };
+    for (int t = 0; t < ntris; ++t)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            const int a = corners[t * 3 + j].ivert;
+            const int b = corners[t * 3 + (j + 1) % 3].ivert;
+            push(a, b);
+            push(b, a);
+        }
+    }
+
+    std::vector<int> around_from;
+    std::vector<int> around_to;
+    int nfaces = ntris;
+    while (nfaces > target_faces && !heap.empty())
+    {
+        const Collapse c = heap.top();
+        heap.pop();
+        const int u = c.from;
+        const int v = c.to;
+        if (removed[u] || removed[v] || version[u] != c.from_version || version[v] != c.to_version)
+        {
+            continue;
+        }
+
+        // the faces on the edge disappear, v's attributes on them continue u's chart
+        int shared = 0;
+        int uvindex = -1;
+        int normindex = -1;
+        around_from.clear();
+        for (int t : adjacency[u])
+        {
+            bool has_v = false;
+            for (int j = 0; j < 3; ++j)
+            {
+                const Vec3i& corner = corners[t * 3 + j];
+                if (corner.ivert == v)
+                {
+                    has_v = true;
+                    uvindex = corner.iuv;
+                    normindex = corner.inorm;
+                }
+                else if (corner.ivert != u)
+                {
+                    around_from.push_back(corner.ivert);
+                }
+            }
+            shared += has_v;
+        }
+        if (shared == 0)
+        {
+            continue;
+        }
+
+        // link condition: u and v may only have the apexes of the shared faces as common neighbours
+        around_to.clear();
+        for (int t : adjacency[v])
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                if (corners[t * 3 + j].ivert != v)
+                {
+                    around_to.push_back(corners[t * 3 + j].ivert);
+                }
+            }
+        }
+        std::sort(around_from.begin(), around_from.end());
+        around_from.erase(std::unique(around_from.begin(), around_from.end()), around_from.end());
+        std::sort(around_to.begin(), around_to.end());
+        around_to.erase(std::unique(around_to.begin(), around_to.end()), around_to.end());
+        int common = 0;
+        for (int w : around_from)
+        {
+            common += std::binary_search(around_to.begin(), around_to.end(), w) ? 1 : 0;
+        }
+        if (common != shared)
+        {
+            continue;
+        }
+
+        // refuse collapses that fold a remaining face over
+        bool flips = false;
+        for (int t : adjacency[u])
+        {
+            int idx[3];
+            bool has_v = false;
+            for (int j = 0; j < 3; ++j)
+            {
+                idx[j] = corners[t * 3 + j].ivert;
+                has_v = has_v || idx[j] == v;
+            }
+            if (has_v)
+            {
+                continue;
+            }
+            Vec3f before = face_normal(verts, idx[0], idx[1], idx[2]);
+            for (int j = 0; j < 3; ++j)
+            {
+                idx[j] = idx[j] == u ? v : idx[j];
+            }
+            Vec3f after = face_normal(verts, idx[0], idx[1], idx[2]);
+            float len = before.norm() * after.norm();
+            if (len <= 0.f || before * after < SIMPLIFY_MAX_FLIP * len)
+            {
+                flips = true;
+                break;
+            }
+        }
+        if (flips)
+        {
+            continue;
+        }
+
+        for (int t : adjacency[u])
+        {
+            bool has_v = false;
+            for (int j = 0; j < 3; ++j)
+            {
+                has_v = has_v || corners[t * 3 + j].ivert == v;
+            }
+            if (has_v)
+            {
+                dead[t] = 1;
+                --nfaces;
+                continue;
+            }
+            for (int j = 0; j < 3; ++j)
+            {
+                Vec3i& corner = corners[t * 3 + j];
+                if (corner.ivert == u)
+                {
+                    corner = Vec3i(v, uvindex, normindex);
+                }
+            }
+            adjacency[v].push_back(t);
+        }
+        adjacency[u].clear();
+        removed[u] = 1;
+        adjacency[v].erase(std::remove_if(adjacency[v].begin(), adjacency[v].end(), [&](int t)
+        {
+            return dead[t] != 0;
+        }), adjacency[v].end());
+        quadrics[v].add(quadrics[u]);
+        ++version[v];
+
+        // every queued edge of v is stale now, queue them again with the merged quadric
+        for (int t : adjacency[v])
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                const int w = corners[t * 3 + j].ivert;
+                if (w != v)
+                {
+                    push(v, w);
+                    push(w, v);
+                }
+            }
+        }
+    }
+
+    std::vector<Vec3i> result;
+    result.reserve(nfaces * 3);
+    for (int t = 0; t < ntris; ++t)
+    {
+        if (!dead[t])
+        {
+            result.insert(result.end(), corners.begin() + t * 3, corners.begin() + t * 3 + 3);
+        }
+    }
+    corners.swap(result);
+}
@@ -0,0 +1,15 @@
+﻿#pragma once
+#include <vector>
+#include "geometry.h"
+
+/**
+ * \brief Quadric error metric simplification (Garland and Heckbert 1997) by half edge collapses.
+ * A vertex is merged into a neighbour, the pair with the smallest summed plane quadric error first,
+ * until target_faces remain or no collapse is allowed. Vertices on a uv or normal seam and on mesh borders
+ * never move, so texture charts and silhouettes of open meshes keep their outlines, and collapses that
+ * would flip a face or make the mesh non manifold are refused.
+ * Surviving vertices keep their position and attributes, so the existing arrays can be indexed as they are.
+ * \param verts Positions
+ * \param corners Three (ivert, iuv, inorm) per triangle, replaced by the simplified triangles
+ */
+void simplify_mesh(const std::vector<Vec3f>& verts, std::vector<Vec3i>& corners, int target_faces);
@@ -0,0 +1,88 @@
+﻿#include "texturecache.h"
+
+#include <iostream>
+#include <sys/stat.h>
+
+TextureCache& TextureCache::instance()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+TextureCache::TextureCache()
+{
+}
+
+std::shared_ptr<TGAImage> TextureCache::load(const std::string& path, bool optional)
+{
+    struct stat st;
+    if (optional && stat(path.c_str(), &st) != 0)
+    {
+        return std::make_shared<TGAImage>();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            auto it = entries_.find(path);
+            if (it == entries_.end())
+            {
+                break;
+            }
+            if (it->second.ready)
+            {
+                return it->second.image;
+            }
+            // Someone else is decoding it, wait instead of reading the file twice
+            loaded_.wait(lock);
+        }
+        entries_[path] = Entry{nullptr, false};
+    }
+
+    std::shared_ptr<TGAImage> image = std::make_shared<TGAImage>();
+    if (!image->read_tga_file(path.c_str()))
+    {
+        std::cerr << "texture file " << path << " loading failed" << std::endl;
+    }
+    image->flip_vertically();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[path] = Entry{image, true};
+    }
+    loaded_.notify_all();
+    return image;
+}
+
+void TextureCache::evict_unused()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();)
+    {
+        if (it->second.ready && it->second.image.use_count() == 1)
+        {
+            it = entries_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void TextureCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();)
+    {
+        // entries still being decoded are kept, their loader will fill them in
+        it = it->second.ready ? entries_.erase(it) : std::next(it);
+    }
+}
+
+int TextureCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)entries_.size();
+}
@@ -0,0 +1,49 @@
+﻿#pragma once
+#include <map>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "tgaimage.h"
+
+/**
+ * \brief Process-wide cache of decoded textures keyed by file path.
+ * Models loading the same map share one decoded TGAImage, and batch jobs that reload an asset skip the decode.
+ * Optional maps whose file doesn't exist are skipped silently and not cached. Files that exist but fail to decode
+ * are reported and cached as an empty image, so the failure is reported once.
+ * Thread-safe; concurrent loads of the same path decode it once and the other callers wait for it.
+ */
+class TextureCache
+{
+public:
+    static TextureCache& instance();
+
+    /**
+     * \brief Decoded texture for path, flipped so v grows upwards like the obj uv coordinates.
+     * \param optional A missing file is expected, don't report it
+     * \return Never null, an image with no buffer if the file couldn't be read
+     */
+    std::shared_ptr<TGAImage> load(const std::string& path, bool optional = false);
+
+    /**
+     * \brief Drop the textures no model references anymore
+     */
+    void evict_unused();
+
+    void clear();
+
+    int size();
+
+private:
+    TextureCache();
+
+    struct Entry
+    {
+        std::shared_ptr<TGAImage> image;
+        bool ready;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable loaded_;
+    std::map<std::string, Entry> entries_;
+};
@@ -1,73 +1,232 @@
 ﻿#include "tgaimage.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
-TGAImage::TGAImage()
-    : data(nullptr),
+#include "imageencoder.h"
+#include "threadpool.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+TGAAllocator* TGAAllocator::default_allocator()
+{
+    // never destroyed: images held by function-local statics such as the TextureCache release their buffers
+    // through it during exit, possibly after a static allocator would be gone
+    static AlignedAllocator* allocator = new AlignedAllocator;
+    return allocator;
+}
+
+unsigned char* AlignedAllocator::allocate(unsigned long nbytes)
+{
+#ifdef _MSC_VER
+    return (unsigned char*)_aligned_malloc(nbytes, TGA_BUFFER_ALIGNMENT);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, TGA_BUFFER_ALIGNMENT, nbytes) != 0)
+    {
+        return nullptr;
+    }
+    return (unsigned char*)p;
+#endif
+}
+
+void AlignedAllocator::deallocate(unsigned char* p, unsigned long)
+{
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+FramePool::FramePool(TGAAllocator* upstream)
+    : upstream_(upstream ? upstream : TGAAllocator::default_allocator()),
+      cached_bytes_(0)
+{
+}
+
+FramePool::~FramePool()
+{
+    trim();
+}
+
+FramePool& FramePool::frames()
+{
+    static FramePool* pool = new FramePool();
+    return *pool;
+}
+
+unsigned char* FramePool::allocate(unsigned long nbytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = free_.find(nbytes);
+        if (it != free_.end() && !it->second.empty())
+        {
+            unsigned char* p = it->second.back();
+            it->second.pop_back();
+            cached_bytes_ -= nbytes;
+            return p;
+        }
+    }
+    return upstream_->allocate(nbytes);
+}
+
+void FramePool::deallocate(unsigned char* p, unsigned long nbytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_[nbytes].push_back(p);
+    cached_bytes_ += nbytes;
+}
+
+void FramePool::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& bucket : free_)
+    {
+        for (unsigned char* p : bucket.second)
+        {
+            upstream_->deallocate(p, bucket.first);
+        }
+    }
+    free_.clear();
+    cached_bytes_ = 0;
+}
+
+unsigned long FramePool::cached_bytes()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cached_bytes_;
+}
+
+TGAImage::TGAImage(TGAAllocator* allocator)
+    : allocator(allocator ? allocator : TGAAllocator::default_allocator()),
+      data(nullptr),
+      datasize(0),
       width(0),
       height(0),
       bytespp(0)
 {
 }
 
-TGAImage::TGAImage(int w, int h, int bpp)
-    : data(nullptr),
+TGAImage::TGAImage(int w, int h, int bpp, TGAAllocator* allocator)
+    : allocator(allocator ? allocator : TGAAllocator::default_allocator()),
+      data(nullptr),
+      datasize(0),
       width(w),
       height(h),
       bytespp(bpp)
 {
     unsigned long nbytes = width * height * bytespp;
-    data = new unsigned char[nbytes];
+    resize_buffer(nbytes);
     memset(data, 0, nbytes);
 }
 
 TGAImage::TGAImage(const TGAImage& other)
+    : allocator(other.allocator),
+      data(nullptr),
+      datasize(0),
+      width(other.width),
+      height(other.height),
+      bytespp(other.bytespp)
 {
-    width = other.width;
-    height = other.height;
-    bytespp = other.bytespp;
-    unsigned long nbytes = width * height * bytespp;
-    data = new unsigned char[nbytes];
-    memcpy(data, other.data, nbytes);
+    resize_buffer(other.datasize);
+    memcpy(data, other.data, datasize);
+}
+
+TGAImage::TGAImage(TGAImage&& other) noexcept
+    : allocator(other.allocator),
+      data(other.data),
+      datasize(other.datasize),
+      width(other.width),
+      height(other.height),
+      bytespp(other.bytespp)
+{
+    other.data = nullptr;
+    other.datasize = 0;
+    other.width = other.height = other.bytespp = 0;
 }
 
 TGAImage::~TGAImage()
 {
-    if (data)
+    release();
+}
+
+TGAImage& TGAImage::operator=(const TGAImage& other)
+{
+    if (this == &other)
     {
-        delete[] data;
+        return *this;
     }
+
+    // Same sized frames copy into the existing buffer instead of reallocating
+    resize_buffer(other.datasize);
+    width = other.width;
+    height = other.height;
+    bytespp = other.bytespp;
+    memcpy(data, other.data, datasize);
+
+    return *this;
 }
 
-TGAImage& TGAImage::operator=(const TGAImage& other)
+TGAImage& TGAImage::operator=(TGAImage&& other) noexcept
 {
     if (this == &other)
     {
         return *this;
     }
 
+    release();
+    allocator = other.allocator;
+    data = other.data;
+    datasize = other.datasize;
     width = other.width;
     height = other.height;
     bytespp = other.bytespp;
-    unsigned long nbytes = width * height * bytespp;
-    data = new unsigned char[nbytes];
-    memcpy(data, other.data, nbytes);
+    other.data = nullptr;
+    other.datasize = 0;
+    other.width = other.height = other.bytespp = 0;
 
     return *this;
 }
 
-bool TGAImage::read_tga_file(const char* filename)
+void TGAImage::resize_buffer(unsigned long nbytes)
+{
+    if (data && datasize == nbytes)
+    {
+        return;
+    }
+    release();
+    if (nbytes)
+    {
+        data = allocator->allocate(nbytes);
+        datasize = nbytes;
+    }
+}
+
+void TGAImage::release()
 {
     if (data)
     {
-        delete[] data;
-        data = nullptr;
+        allocator->deallocate(data, datasize);
     }
+    data = nullptr;
+    datasize = 0;
+}
 
+bool TGAImage::read_tga_file(const char* filename)
+{
     ifstream in;
     in.open(filename, ios::binary);
     if (!in.is_open())
     {
+        release();
         cerr << "can't open file " << filename << "\n";
         in.close();
         return false;
@@ -77,6 +236,7 @@ bool TGAImage::read_tga_file(const char* filename)
     in.read((char*)&header, sizeof(header));
     if (!in.good())
     {
+        release();
         in.close();
         cerr << "an error occured while reading the header\n";
         return false;
@@ -88,13 +248,15 @@ bool TGAImage::read_tga_file(const char* filename)
     bytespp = header.bitsperpixel >> 3;
     if (width <= 0 || height <= 0 || (bytespp != GRAYSCALE && bytespp != RGB && bytespp != RGBA))
     {
+        release();
         in.close();
         cerr << "bad bpp or width/height value\n";
         return false;
     }
 
     unsigned long nbytes = bytespp * width * height;
-    data = new unsigned char[nbytes];
+    // Reloading into an image of the same size reuses its buffer
+    resize_buffer(nbytes);
     if (3 == header.datatypecode || 2 == header.datatypecode)
     {
         in.read((char*)data, nbytes);
@@ -138,11 +300,6 @@ bool TGAImage::read_tga_file(const char* filename)
 
 bool TGAImage::write_tga_file(const char* filename, bool rle)
 {
-    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
-    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
-    unsigned char footer[18] = {
-        'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'
-    };
     ofstream out;
     out.open(filename, ios::binary);
     if (!out.is_open())
@@ -151,6 +308,33 @@ bool TGAImage::write_tga_file(const char* filename, bool rle)
         out.close();
         return false;
     }
+    bool ok = write_tga(out, rle);
+    out.close();
+    return ok;
+}
+
+bool TGAImage::write_file(const char* filename, ImageEncoder& encoder)
+{
+    ofstream out;
+    out.open(filename, ios::binary);
+    if (!out.is_open())
+    {
+        cerr << "can't open file " << filename << "\n";
+        out.close();
+        return false;
+    }
+    bool ok = encoder.encode(*this, out);
+    out.close();
+    return ok;
+}
+
+bool TGAImage::write_tga(std::ostream& out, bool rle)
+{
+    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
+    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
+    unsigned char footer[18] = {
+        'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'
+    };
 
     TGA_Header header;
     memset((void*)&header, 0, sizeof(header));
@@ -161,7 +345,6 @@ bool TGAImage::write_tga_file(const char* filename, bool rle)
     out.write((char*)&header, sizeof(header));
     if (!out.good())
     {
-        out.close();
         cerr<<"can't dump the tga file\n";
         return false;
     }
@@ -169,12 +352,10 @@ bool TGAImage::write_tga_file(const char* filename, bool rle)
         out.write((char *)data, width*height*bytespp);
         if (!out.good()) {
             std::cerr << "can't unload raw data\n";
-            out.close();
             return false;
         }
     } else {
         if (!unload_rle_data(out)) {
-            out.close();
             std::cerr << "can't unload rle data\n";
             return false;
         }
@@ -182,22 +363,18 @@ bool TGAImage::write_tga_file(const char* filename, bool rle)
     out.write((char *)developer_area_ref, sizeof(developer_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)extension_area_ref, sizeof(extension_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
-    out.close();
     return true;
 }
 
@@ -230,7 +407,7 @@ bool TGAImage::flip_vertically()
     }
 
     unsigned long bytes_per_line = width * bytespp;
-    unsigned char* line = new unsigned char[bytes_per_line];
+    unsigned char* line = allocator->allocate(bytes_per_line);
     int half = height >> 1;
     for (int j = 0; j < half; ++j)
     {
@@ -240,53 +417,317 @@ bool TGAImage::flip_vertically()
         memmove((void*)(data + l1), (void*)(data + l2), bytes_per_line);
         memmove((void*)(data + l2), (void*)line, bytes_per_line);
     }
-    delete[] line;
+    allocator->deallocate(line, bytes_per_line);
     return true;
 }
 
-bool TGAImage::scale(int w, int h)
+namespace
 {
-    if (w <= 0 || h <= 0 || !data)
+    // Fixed point precision of the resampling weights, 1.0 == 1 << SCALE_PRECISION
+    const int SCALE_PRECISION = 14;
+
+    // Images smaller than this (in output bytes) are resampled on the calling thread only
+    const unsigned long SCALE_PARALLEL_THRESHOLD = 256 * 256 * 3;
+
+    /**
+     * \brief Per-axis filter taps: output sample i reads `taps` input samples starting at start[i]
+     * with the fixed point weights coeffs[i * taps ... i * taps + taps - 1].
+     */
+    struct ScaleWeights
     {
-        return false;
+        int taps;
+        std::vector<int> start;
+        std::vector<short> coeffs;
+    };
+
+    float filter_support(TGAImage::Filter filter)
+    {
+        switch (filter)
+        {
+        case TGAImage::BOX:
+            return 0.5f;
+        case TGAImage::BILINEAR:
+            return 1.f;
+        case TGAImage::LANCZOS:
+            return 3.f;
+        default:
+            return 0.f;
+        }
+    }
+
+    float sinc(float x)
+    {
+        if (x == 0.f)
+        {
+            return 1.f;
+        }
+        x *= 3.14159265358979f;
+        return std::sin(x) / x;
     }
 
-    unsigned char* tdata = new unsigned char[w * h * bytespp];
-    int nscanline = 0;
-    int oscanline = 0;
-    int erry = 0;
-    unsigned long nlinebytes = w * bytespp;
-    unsigned long olinebytes = width * bytespp;
-    for (int j = 0; j < height; ++j)
+    float filter_kernel(TGAImage::Filter filter, float x)
     {
-        int errx = width - w;
-        int nx = -bytespp;
-        int ox = -bytespp;
-        for (int i = 0; i < width; ++i)
+        switch (filter)
         {
-            ox += bytespp;
-            errx += w;
-            while (errx >= (int)width)
+        case TGAImage::BOX:
+            return (x > -0.5f && x <= 0.5f) ? 1.f : 0.f;
+        case TGAImage::BILINEAR:
+            x = std::fabs(x);
+            return x < 1.f ? 1.f - x : 0.f;
+        case TGAImage::LANCZOS:
+            return (x > -3.f && x < 3.f) ? sinc(x) * sinc(x / 3.f) : 0.f;
+        default:
+            return 0.f;
+        }
+    }
+
+    ScaleWeights compute_scale_weights(int insize, int outsize, TGAImage::Filter filter)
+    {
+        ScaleWeights weights;
+        const float scale = (float)insize / outsize;
+        weights.start.resize(outsize);
+
+        if (filter == TGAImage::NEAREST)
+        {
+            weights.taps = 1;
+            weights.coeffs.assign(outsize, (short)(1 << SCALE_PRECISION));
+            for (int i = 0; i < outsize; ++i)
             {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata + nscanline + nx, data + oscanline + ox, bytespp);
+                weights.start[i] = std::min(insize - 1, (int)((i + .5f) * scale));
             }
+            return weights;
         }
-        erry += h;
-        oscanline += olinebytes;
-        while (erry >= (int)height)
+
+        // When downscaling the kernel is stretched over the footprint of one output sample
+        const float filterscale = std::max(1.f, scale);
+        const float support = filter_support(filter) * filterscale;
+        weights.taps = std::min(insize, (int)std::ceil(support) * 2 + 1);
+        weights.coeffs.assign((size_t)outsize * weights.taps, 0);
+
+        std::vector<float> w(weights.taps);
+        for (int i = 0; i < outsize; ++i)
         {
-            if (erry >= (int)height << 1)
+            const float center = (i + .5f) * scale;
+            int xmin = std::max(0, (int)(center - support + .5f));
+            int xmax = std::min(insize, (int)(center + support + .5f));
+            xmax = std::min(xmax, xmin + weights.taps);
+            // Keep the window inside the image so the row kernels never need bounds checks
+            xmin = std::max(0, std::min(xmin, insize - weights.taps));
+
+            float total = 0.f;
+            for (int k = 0; k < weights.taps; ++k)
+            {
+                const int x = xmin + k;
+                w[k] = x < xmax ? filter_kernel(filter, (x - center + .5f) / filterscale) : 0.f;
+                total += w[k];
+            }
+            if (total == 0.f)
+            {
+                w[std::min(weights.taps - 1, std::max(0, (int)center - xmin))] = total = 1.f;
+            }
+
+            // Quantize and push the rounding error into the largest tap so every row sums to exactly 1.0
+            short* coeffs = &weights.coeffs[(size_t)i * weights.taps];
+            int sum = 0;
+            int largest = 0;
+            for (int k = 0; k < weights.taps; ++k)
             {
-                memcpy(tdata + nscanline + nlinebytes, tdata + nscanline, nlinebytes);
+                coeffs[k] = (short)std::lround(w[k] / total * (1 << SCALE_PRECISION));
+                sum += coeffs[k];
+                if (std::abs(coeffs[k]) > std::abs(coeffs[largest]))
+                {
+                    largest = k;
+                }
             }
-            erry -= height;
-            nscanline += nlinebytes;
+            coeffs[largest] = (short)(coeffs[largest] + (1 << SCALE_PRECISION) - sum);
+            weights.start[i] = xmin;
         }
+        return weights;
     }
-    delete[] data;
+
+    inline unsigned char clamp_weighted(int sum)
+    {
+        sum = (sum + (1 << (SCALE_PRECISION - 1))) >> SCALE_PRECISION;
+        return (unsigned char)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
+    }
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    /**
+     * \brief One RGB or RGBA output pixel of the horizontal pass. Two neighbouring taps are loaded at once and their
+     * channels interleaved, so one madd weights both; RGB loads read one pixel past the taps.
+     */
+    template <int Bpp>
+    inline void scale_pixel_horizontal(const unsigned char* p, const short* coeffs, int taps, unsigned char* out)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum = _mm_set1_epi32(1 << (SCALE_PRECISION - 1));
+        int k = 0;
+        for (; k + 1 < taps; k += 2)
+        {
+            const __m128i two = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + k * Bpp)), zero);
+            const __m128i pairs = _mm_unpacklo_epi16(two, _mm_srli_si128(two, Bpp * 2));
+            const __m128i w = _mm_set1_epi32(
+                (int)((unsigned)(unsigned short)coeffs[k] | ((unsigned)(unsigned short)coeffs[k + 1] << 16)));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pairs, w));
+        }
+        if (k < taps)
+        {
+            int last;
+            memcpy(&last, p + k * Bpp, sizeof(last));
+            const __m128i one = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(last), zero), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(one, _mm_set1_epi32((unsigned short)coeffs[k])));
+        }
+        sum = _mm_srai_epi32(sum, SCALE_PRECISION);
+        const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(sum, zero), zero));
+        memcpy(out, &packed, Bpp);
+    }
+#endif
+
+    template <int Bpp>
+    void scale_rows_horizontal(const unsigned char* src, int srcwidth, unsigned char* dst, int dstwidth,
+                               int rowbegin, int rowend, const ScaleWeights& weights)
+    {
+        for (int y = rowbegin; y < rowend; ++y)
+        {
+            const unsigned char* in = src + (size_t)y * srcwidth * Bpp;
+            unsigned char* out = dst + (size_t)y * dstwidth * Bpp;
+            for (int x = 0; x < dstwidth; ++x)
+            {
+                const unsigned char* p = in + weights.start[x] * Bpp;
+                const short* coeffs = &weights.coeffs[(size_t)x * weights.taps];
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+                // the RGB loads' extra pixel must stay inside the row
+                if (Bpp == 4 || (Bpp == 3 && weights.start[x] + weights.taps < srcwidth))
+                {
+                    scale_pixel_horizontal<Bpp>(p, coeffs, weights.taps, out + x * Bpp);
+                    continue;
+                }
+#endif
+                int sum[Bpp] = {};
+                for (int k = 0; k < weights.taps; ++k)
+                {
+                    for (int c = 0; c < Bpp; ++c)
+                    {
+                        sum[c] += p[k * Bpp + c] * coeffs[k];
+                    }
+                }
+                for (int c = 0; c < Bpp; ++c)
+                {
+                    out[x * Bpp + c] = clamp_weighted(sum[c]);
+                }
+            }
+        }
+    }
+
+    void scale_rows_vertical(const unsigned char* src, unsigned long linebytes, unsigned char* dst,
+                             int rowbegin, int rowend, const ScaleWeights& weights)
+    {
+        for (int y = rowbegin; y < rowend; ++y)
+        {
+            const unsigned char* in = src + (size_t)weights.start[y] * linebytes;
+            const short* coeffs = &weights.coeffs[(size_t)y * weights.taps];
+            unsigned char* out = dst + (size_t)y * linebytes;
+            unsigned long i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+            // 8 bytes per iteration, taps are consumed in pairs with madd over interleaved rows
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i rounding = _mm_set1_epi32(1 << (SCALE_PRECISION - 1));
+            for (; i + 8 <= linebytes; i += 8)
+            {
+                __m128i lo = rounding;
+                __m128i hi = rounding;
+                int k = 0;
+                for (; k + 1 < weights.taps; k += 2)
+                {
+                    const __m128i r0 = _mm_loadl_epi64((const __m128i*)(in + k * linebytes + i));
+                    const __m128i r1 = _mm_loadl_epi64((const __m128i*)(in + (k + 1) * linebytes + i));
+                    const __m128i w = _mm_set1_epi32(
+                        (int)((unsigned)(unsigned short)coeffs[k] | ((unsigned)(unsigned short)coeffs[k + 1] << 16)));
+                    const __m128i pairs = _mm_unpacklo_epi8(r0, r1);
+                    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi8(pairs, zero), w));
+                    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi8(pairs, zero), w));
+                }
+                if (k < weights.taps)
+                {
+                    const __m128i r0 = _mm_loadl_epi64((const __m128i*)(in + k * linebytes + i));
+                    const __m128i w = _mm_set1_epi32((unsigned short)coeffs[k]);
+                    const __m128i pairs = _mm_unpacklo_epi8(r0, zero);
+                    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(pairs, zero), w));
+                    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(pairs, zero), w));
+                }
+                lo = _mm_srai_epi32(lo, SCALE_PRECISION);
+                hi = _mm_srai_epi32(hi, SCALE_PRECISION);
+                const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero);
+                _mm_storel_epi64((__m128i*)(out + i), packed);
+            }
+#endif
+            for (; i < linebytes; ++i)
+            {
+                int sum = 0;
+                for (int k = 0; k < weights.taps; ++k)
+                {
+                    sum += in[k * linebytes + i] * coeffs[k];
+                }
+                out[i] = clamp_weighted(sum);
+            }
+        }
+    }
+
+    /**
+     * \brief Split [0, rows) into contiguous blocks and run job(begin, end) on each through the shared ThreadPool
+     */
+    template <class Job>
+    void run_row_blocks(int rows, unsigned long workbytes, const Job& job)
+    {
+        ThreadPool& pool = ThreadPool::instance();
+        if (workbytes < SCALE_PARALLEL_THRESHOLD || pool.nthreads() <= 1)
+        {
+            job(0, rows);
+            return;
+        }
+        // a few blocks per thread so stealing can even out the load
+        pool.parallel_for(0, rows, std::max(1, rows / (pool.nthreads() * 4)), job);
+    }
+}
+
+bool TGAImage::scale(int w, int h, Filter filter)
+{
+    if (w <= 0 || h <= 0 || !data)
+    {
+        return false;
+    }
+
+    // Horizontal pass: height x w intermediate, then vertical pass: h x w result
+    const ScaleWeights xweights = compute_scale_weights(width, w, filter);
+    const ScaleWeights yweights = compute_scale_weights(height, h, filter);
+    const unsigned long nlinebytes = w * bytespp;
+    unsigned char* hdata = allocator->allocate(height * nlinebytes);
+    unsigned char* tdata = allocator->allocate(h * nlinebytes);
+
+    run_row_blocks(height, height * nlinebytes, [&](int begin, int end)
+    {
+        switch (bytespp)
+        {
+        case GRAYSCALE:
+            scale_rows_horizontal<GRAYSCALE>(data, width, hdata, w, begin, end, xweights);
+            break;
+        case RGB:
+            scale_rows_horizontal<RGB>(data, width, hdata, w, begin, end, xweights);
+            break;
+        default:
+            scale_rows_horizontal<RGBA>(data, width, hdata, w, begin, end, xweights);
+            break;
+        }
+    });
+    run_row_blocks(h, h * nlinebytes, [&](int begin, int end)
+    {
+        scale_rows_vertical(hdata, nlinebytes, tdata, begin, end, yweights);
+    });
+
+    allocator->deallocate(hdata, height * nlinebytes);
+    release();
     data = tdata;
+    datasize = h * nlinebytes;
     width = w;
     height = h;
     return true;
@@ -326,6 +767,11 @@ int TGAImage::get_bytespp()
     return bytespp;
 }
 
+TGAAllocator* TGAImage::get_allocator()
+{
+    return allocator;
+}
+
 unsigned char* TGAImage::buffer()
 {
     return data;
@@ -402,7 +848,7 @@ bool TGAImage::load_rle_data(std::ifstream& in)
     return true;
 }
 
-bool TGAImage::unload_rle_data(std::ofstream& out)
+bool TGAImage::unload_rle_data(std::ostream& out)
 {
     const unsigned char max_chunk_length = 128;
     unsigned long npixels = width * height;
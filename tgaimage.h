@@ -1,8 +1,13 @@
 ﻿#pragma once
 
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <vector>
 using namespace std;
 
+class ImageEncoder;
+
 #pragma pack(push,1)
 /**
  * \brief The header information in a TGA file includes various parameters that describe the image,
@@ -95,6 +100,76 @@ struct TGAColor
     int bytespp;
 };
 
+/**
+ * \brief Where TGAImage gets its pixel storage from.
+ * Every buffer handed out is aligned to TGA_BUFFER_ALIGNMENT bytes so row kernels can use aligned SIMD access.
+ */
+class TGAAllocator
+{
+public:
+    virtual ~TGAAllocator()
+    {
+    }
+
+    virtual unsigned char* allocate(unsigned long nbytes) = 0;
+
+    virtual void deallocate(unsigned char* p, unsigned long nbytes) = 0;
+
+    /**
+     * \brief Process-wide aligned heap allocator, used when an image is not given one explicitly
+     */
+    static TGAAllocator* default_allocator();
+};
+
+const unsigned long TGA_BUFFER_ALIGNMENT = 64;
+
+class AlignedAllocator : public TGAAllocator
+{
+public:
+    unsigned char* allocate(unsigned long nbytes) override;
+
+    void deallocate(unsigned char* p, unsigned long nbytes) override;
+};
+
+/**
+ * \brief Recycles released buffers by size, so a render loop that keeps producing frames of the same
+ * dimensions stops touching the heap after the first frame. Thread-safe.
+ * Images allocated from a pool must be destroyed before the pool.
+ */
+class FramePool : public TGAAllocator
+{
+public:
+    FramePool(TGAAllocator* upstream = nullptr);
+
+    ~FramePool() override;
+
+    FramePool(const FramePool&) = delete;
+
+    FramePool& operator=(const FramePool&) = delete;
+
+    /**
+     * \brief Process-wide pool for the images that only live for a frame or a render: the framebuffers and the
+     * exported depth images. Never destroyed, so images released during exit still find it.
+     */
+    static FramePool& frames();
+
+    unsigned char* allocate(unsigned long nbytes) override;
+
+    void deallocate(unsigned char* p, unsigned long nbytes) override;
+
+    /**
+     * \brief Give every cached buffer back to the upstream allocator
+     */
+    void trim();
+
+    unsigned long cached_bytes();
+
+private:
+    TGAAllocator* upstream_;
+    std::mutex mutex_;
+    std::map<unsigned long, std::vector<unsigned char*>> free_;
+    unsigned long cached_bytes_;
+};
 
 class TGAImage
 {
@@ -106,20 +181,43 @@ public:
         RGBA = 4
     };
 
-    TGAImage();
+    /**
+     * \brief Reconstruction filter used by scale(). NEAREST keeps the old point sampling,
+     * the others are separable and prefiltered when downscaling, so thumbnails don't alias.
+     */
+    enum Filter
+    {
+        NEAREST,
+        BOX,
+        BILINEAR,
+        LANCZOS
+    };
+
+    TGAImage(TGAAllocator* allocator = nullptr);
 
-    TGAImage(int w, int h, int bpp);
+    TGAImage(int w, int h, int bpp, TGAAllocator* allocator = nullptr);
 
     TGAImage(const TGAImage& other);
 
+    TGAImage(TGAImage&& other) noexcept;
+
     ~TGAImage();
 
     TGAImage& operator=(const TGAImage& other);
 
+    TGAImage& operator=(TGAImage&& other) noexcept;
+
     bool read_tga_file(const char* filename);
 
     bool write_tga_file(const char* filename, bool rle = true);
 
+    bool write_tga(std::ostream& out, bool rle = true);
+
+    /**
+     * \brief Write the image in the encoder's format
+     */
+    bool write_file(const char* filename, ImageEncoder& encoder);
+
     /**
      * \brief Horizontal Mirror Flip
      * \return If the operation is successful
@@ -132,7 +230,13 @@ public:
      */
     bool flip_vertically();
 
-    bool scale(int w, int h);
+    /**
+     * \brief Resample the image to w x h with a separable filter. Weights are precomputed once per axis,
+     * both passes use SSE2 when available (the horizontal one for RGB and RGBA, grayscale stays scalar there) and
+     * large images are split across threads by row blocks.
+     * \return If the operation is successful
+     */
+    bool scale(int w, int h, Filter filter = BILINEAR);
 
     TGAColor get(int x, int y);
 
@@ -144,6 +248,8 @@ public:
 
     int get_bytespp();
 
+    TGAAllocator* get_allocator();
+
     unsigned char* buffer();
 
     void clear();
@@ -151,9 +257,19 @@ public:
 protected:
     // TODO: Dont understand
     bool load_rle_data(std::ifstream& in);
-    bool unload_rle_data(std::ofstream& out);
+    bool unload_rle_data(std::ostream& out);
+
+    /**
+     * \brief Make data hold exactly nbytes, reusing the current buffer when the size already matches
+     */
+    void resize_buffer(unsigned long nbytes);
+
+    void release();
 
+    TGAAllocator* allocator;
     unsigned char* data;
+    // size in bytes of the block data points to
+    unsigned long datasize;
     int width;
     int height;
     int bytespp;
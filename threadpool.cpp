@@ -0,0 +1,151 @@
+﻿#include "threadpool.h"
+
+#include <algorithm>
+
+namespace
+{
+    // queue of the pool worker running on this thread, -1 on other threads
+    thread_local int worker_index = -1;
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool(std::max(0, (int)std::thread::hardware_concurrency() - 1 - PIPELINE_THREADS));
+    return pool;
+}
+
+ThreadPool::ThreadPool(int nworkers): queued_(0), stop_(false)
+{
+    // one queue per worker plus one for threads outside the pool
+    for (int i = 0; i <= nworkers; ++i)
+    {
+        queues_.emplace_back(new Queue());
+    }
+    for (int i = 0; i < nworkers; ++i)
+    {
+        threads_.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : threads_)
+    {
+        t.join();
+    }
+}
+
+int ThreadPool::nthreads()
+{
+    return (int)threads_.size() + 1;
+}
+
+void ThreadPool::push(int queue, const Task& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+        queues_[queue]->tasks.push_back(task);
+    }
+    queued_++;
+}
+
+bool ThreadPool::pop(int self, Task& task)
+{
+    const int nqueues = (int)queues_.size();
+    const int own = self >= 0 ? self : nqueues - 1;
+    for (int i = 0; i < nqueues; ++i)
+    {
+        Queue& queue = *queues_[(own + i) % nqueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        queued_--;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::worker(int self)
+{
+    worker_index = self;
+    Task task;
+    for (;;)
+    {
+        if (pop(self, task))
+        {
+            (*task.body)(task.begin, task.end);
+            (*task.pending)--;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this]
+        {
+            return stop_ || queued_ > 0;
+        });
+        if (stop_)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& body)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+    grain = std::max(1, grain);
+    if (threads_.empty() || end - begin <= grain)
+    {
+        body(begin, end);
+        return;
+    }
+
+    // ranges are dealt round robin so every worker starts on its own queue without stealing
+    std::atomic<int> pending(0);
+    const int nqueues = (int)queues_.size();
+    int queue = worker_index >= 0 ? worker_index : nqueues - 1;
+    for (int b = begin; b < end; b += grain)
+    {
+        pending++;
+        push(queue, Task{&body, b, std::min(end, b + grain), &pending});
+        queue = (queue + 1) % nqueues;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_all();
+
+    // help until every range finished, ranges taken by others may still be running when the queues are empty
+    Task task;
+    while (pending > 0)
+    {
+        if (pop(worker_index, task))
+        {
+            (*task.body)(task.begin, task.end);
+            (*task.pending)--;
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,70 @@
+﻿#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief Work-stealing thread pool for the data parallel loops, the vertex transform and image scaling.
+ * Rasterization stays serial on the FramePipeline's raster stage, and the pipeline's other stages run on threads
+ * of their own; the process wide pool leaves a core to each of those, so a render doesn't oversubscribe the cores.
+ * Each worker has its own queue: it takes work from the back of it and, when empty, steals from the front of
+ * the others. The thread calling parallel_for works on the range too, so nested calls can't deadlock.
+ */
+class ThreadPool
+{
+public:
+    // threads FramePipeline runs besides the rasterizing caller, its geometry and encode stages
+    static const int PIPELINE_THREADS = 2;
+
+    /**
+     * \brief The process wide pool, one worker per core besides the calling thread and the PIPELINE_THREADS
+     */
+    static ThreadPool& instance();
+
+    explicit ThreadPool(int nworkers);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // threads working on a parallel_for, the workers and the caller
+    int nthreads();
+
+    /**
+     * \brief Run body(begin, end) over [begin, end) split into contiguous ranges of about grain items,
+     * and return once all ranges are done
+     */
+    void parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& body);
+
+private:
+    struct Task
+    {
+        const std::function<void(int, int)>* body;
+        int begin;
+        int end;
+        std::atomic<int>* pending;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void worker(int self);
+    // own queue first (back), then steal from the others (front)
+    bool pop(int self, Task& task);
+    void push(int queue, const Task& task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<int> queued_;
+    bool stop_;
+};